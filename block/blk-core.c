@@ -189,7 +189,7 @@ static void req_bio_endio(struct request *rq, struct bio *bio,
 	/* don't actually finish bio if it's part of flush sequence */
 	if (bio->bi_size == 0 && !(rq->cmd_flags & REQ_FLUSH_SEQ)) {
 #ifdef CONFIG_SCSI_SWAP_BADSECTORS
-		if(swap_bio(bio, start_sec, size, bad_sec, error, 1))
+		if(swap_bio(bio, rq->part, start_sec, size, bad_sec, error, 1))
 			return;
 #endif
 		bio_endio(bio, error);
@@ -1812,7 +1812,11 @@ void generic_make_request(struct bio *bio)
 #ifdef CONFIG_SCSI_SWAP_BADSECTORS
     if (bio_has_bad_block(bio))
     {
-        if(!swap_bio(bio, bio->bi_sector, bio->bi_size, -1, -EIO, 0))
+        /* only the remapped blocks go to swap, the rest is resubmitted */
+        if (swap_split_bio(bio))
+            return;
+
+        if(!swap_bio(bio, NULL, bio->bi_sector, bio->bi_size, -1, -EIO, 0))
         {
 		    bio_endio(bio, -EIO);
         }
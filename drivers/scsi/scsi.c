@@ -787,8 +787,9 @@ int scsi_dispatch_cmd(struct scsi_cmnd *cmd)
 static void scsi_done(struct scsi_cmnd *cmd)
 {
 #ifdef CONFIG_SCSI_SIM_BADSECTORS
-	if(scmd_should_be_bad(cmd))
-		cmd->result |= (DRIVER_INVALID << 24 | DID_ABORT << 16);
+	/* simulated slow sectors are completed later from a timer */
+	if (scmd_simulate_done(cmd))
+		return;
 #endif
 	trace_scsi_dispatch_cmd_done(cmd);
 	blk_complete_request(cmd->request);
@@ -1,10 +1,15 @@
 #include <scsi/scsi_swap.h>
 #include <linux/delay.h>
+#include <linux/rculist.h>
+#include <linux/moduleparam.h>
+#include <linux/log2.h>
 
 #include "swap.h"
 #include "crc32.h"
 #include "utils.h"
 
+#include <trace/events/scsi_swap.h>
+
 #undef debug_info
 
 #ifdef debug_info
@@ -40,10 +45,19 @@ typedef struct swap_table {
     sector_t save_sec;       /* 保存的扇区号，不算入checksum */
 } swap_table_t;
 
+// 16字节, 0002格式的盘上表项, 替换扇区和扇区数由index算出
+typedef struct swap_table_compact {
+    u64 src_sec;        /* 源块起始扇区号 */
+    u32 index;          /* 交换块替换扇区编号 取值为 0 ~ MAX_SWAP_BLOCK-1 */
+    u32 checksum;       /* 校验前12字节 */
+} swap_table_compact_t;
+
 typedef struct swap_info {
     struct list_head list;
     struct swap_table table;    /* 块替换表 */
-    char *data;                 /* 替换扇区的数据指针 */
+    char *data;                 /* 替换扇区的数据缓存, 没有缓存时为NULL */
+    struct list_head lru;       /* 在core->cache_lru上, 没有缓存时为空 */
+    struct rcu_head rcu;        /* 从链表删除后, 等读者退出再释放 */
     u32 reserverd[5];
 } swap_info_t;
 
@@ -69,11 +83,30 @@ typedef enum swap_table_sync{
     BACKUP_NEED_SYNC,                    /* 损坏 */
 }swap_table_sync_e;
 
-static inline int get_swap_block_count(sector_t start, int count)
+/* 一次并发提交的最大block数 */
+#define SWAP_AIO_BATCH      8
+
+/* 每个盘缓存映射块数据的最大块数, 每块SWAP_BLOCK_SIZE, 其余的从映射块读写 */
+static unsigned int swap_cache_blocks = 32;
+module_param(swap_cache_blocks, uint, S_IRUGO);
+MODULE_PARM_DESC(swap_cache_blocks, "remapped blocks cached in RAM per disk");
+
+/* 新建头时的替换块扇区数, 已有的盘用头里记录的值 */
+static unsigned int swap_block_sectors = SECTOR_NUM_PER_SWAP_BLOCK;
+module_param(swap_block_sectors, uint, S_IRUGO);
+MODULE_PARM_DESC(swap_block_sectors, "remap granularity in sectors for newly formatted disks (8, 16, 32, 64 or 128)");
+
+static inline int get_swap_block_count(struct scsi_swap_core *core, sector_t start, int count)
 {
-    int nlen = start + count - SWAP_SECTOR_ALIGN(start); // 对齐后的总长度
+    int nlen = start + count - SWAP_SECTOR_ALIGN(core, start); // 对齐后的总长度
+
+    return (nlen + core->block_sectors - 1) >> core->block_shift;
+}
 
-    return nlen/SECTOR_NUM_PER_SWAP_BLOCK + (nlen%SECTOR_NUM_PER_SWAP_BLOCK == 0 ? 0 : 1);
+/* 替换块扇区数是否合法: 2的幂, 4K到64K */
+static inline bool swap_block_sectors_valid(u32 n)
+{
+    return is_power_of_2(n) && n >= SWAP_BLOCK_SECTORS_MIN && n <= SECTOR_NUM_PER_SWAP_BLOCK;
 }
 
 // 标记一个交换已用
@@ -109,89 +142,29 @@ static inline int flush_swap_info_data(struct scsi_swap_core *core, struct swap_
 			info->table.sec_size, info->data, info->table.sec_size * SECTOR_SIZE);
 }
 
-
-//功能描述  : 更新映射表，一次把所有表都重新写入
-//返 回 值  : 0 成功 -1 失败
-static int flush_swap_info_table(struct scsi_swap_core *core)
+/* 块内[offset, offset+count)扇区扩到物理块边界, 写映射块时只写这一段 */
+static inline void swap_dirty_range(struct scsi_swap_core *core, struct swap_info *info, 
+        int offset, int count, int *d_start, int *d_count)
 {
-    struct swap_info *entry;
-    struct swap_info *next;
-    struct list_head *head = &core->info_list;
-    int table_num = SECTOR_SIZE/sizeof(struct swap_table); //每个扇区可以放的swap_table个数
-    char buffer[SECTOR_SIZE] = {0};
-    sector_t sect_index = core->sector_table;
-    sector_t sect_back_index = core->sector_reserve_start + SWAP_TABLE_BACKUP_OFFSET;
-    int i = 0;
-	struct scsi_device *device = core_to_scsi_device(core);
-
-    spin_lock(&core->info_list_lock);
-
-    list_for_each_entry_safe(entry, next, head, list)
-    {
-        /* 如果是重新开一个扇区，先清零 */
-        if (0 == i)
-        {
-            memset(buffer, 0 , sizeof(buffer));
-        }
-
-        /* 映射表所在的扇区号，只记录主映射表，备份映射表可计算得到 */
-        entry->table.save_sec = sect_index;
-        
-        memcpy(buffer + i*sizeof(struct swap_table), &entry->table, sizeof(struct swap_table));
+    int end = min_t(int, ALIGN(offset + count, core->phys_sectors), info->table.sec_size);
 
-        if(i++ == (table_num - 1))
-        {
-            /* 写入主映射表，碰到写错误，跳过 */
-            while (0 != hd_write_sector_retry(device, sect_index++, 1, buffer, SECTOR_SIZE)) 
-            {
-                SWAP_ERR("flush master table failed\n");
-                if (sect_index >= (core->sector_table + SWPA_TABLE_N_SECTOR))
-                {
-                    break;
-                }
-            }
+    *d_start = round_down(offset, core->phys_sectors);
+    *d_count = end - *d_start;
+}
 
-            /* 写入备份映射表，碰到写错误，跳过 */
-            while (0 != hd_write_sector_retry(device, sect_back_index++, 1, buffer, SECTOR_SIZE)) 
-            {
-                SWAP_ERR("flush master table failed\n");
-                if (sect_back_index >= (core->sector_reserve_start + SWAP_TABLE_BACKUP_OFFSET + SWPA_TABLE_N_SECTOR))
-                {
-                    break;
-                }
-            }
-            
-            i = 0;
-        }
-    }
-    spin_unlock(&core->info_list_lock);
+//  只写块内更新过的扇区
+static inline int flush_swap_info_range(struct scsi_swap_core *core, struct swap_info *info, int offset, int count)
+{
+	struct scsi_device *sdev = core_to_scsi_device(core);
+    int d_start;
+    int d_count;
 
-    /* 如果最后的信息不足一个扇区，继续写入 */
-    if (0 != i)
-    {
-        /* 写入主映射表，碰到写错误，跳过 */
-        while (0 != hd_write_sector_retry(device, sect_index++, 1, buffer, SECTOR_SIZE)) 
-        {
-            SWAP_ERR("flush master table failed\n");
-            if (sect_index >= (core->sector_table + SWPA_TABLE_N_SECTOR))
-            {
-                break;
-            }
-        }
+    swap_dirty_range(core, info, offset, count, &d_start, &d_count);
+    return hd_write_sector_retry(sdev, info->table.swap_sec + d_start, 
+			d_count, info->data + d_start * SECTOR_SIZE, d_count * SECTOR_SIZE);
+}
 
-        /* 写入备份映射表，碰到写错误，跳过 */
-        while (0 != hd_write_sector_retry(device, sect_back_index++, 1, buffer, SECTOR_SIZE)) 
-        {
-            SWAP_ERR("flush master table failed\n");
-            if (sect_back_index >= (core->sector_reserve_start + SWAP_TABLE_BACKUP_OFFSET + SWPA_TABLE_N_SECTOR))
-            {
-                break;
-            }
-        }
-    }
 
-    return 0;
-}
 
 
 /* 由scsi_device找到对应交换结构 */
@@ -219,36 +192,78 @@ static int flush_swap_info_table(struct scsi_swap_core *core)
 static swap_info_t *swap_find_swap_info(struct scsi_swap_core *core, sector_t sector)
 {
     swap_info_t *info;
-    swap_info_t *next;
 
     if (NULL == core)
     {
         return NULL;
     }
 
-    spin_lock(&core->info_list_lock);
+    /* 映射只在硬盘销毁时释放, 返回后可以继续使用 */
+    rcu_read_lock();
+    info = radix_tree_lookup(&core->info_tree, SWAP_BLOCK_INDEX(core, sector));
+    rcu_read_unlock();
+    
+    return info;
+}
+
+/* 查找[start, end)范围内的第一个映射块, 一次radix tree查找 */
+static swap_info_t *swap_find_first_swap_info(struct scsi_swap_core *core, sector_t start, sector_t end)
+{
+    swap_info_t *info = NULL;
+
+    rcu_read_lock();
+    if (1 != radix_tree_gang_lookup(&core->info_tree, (void **)&info, SWAP_BLOCK_INDEX(core, start), 1))
+    {
+        info = NULL;
+    }
+    rcu_read_unlock();
+
+    if (NULL != info && info->table.src_sec >= end)
+    {
+        return NULL;
+    }
+
+    return info;
+}
+
+/* 加入映射表链表和索引, 读者可能同时在查找 */
+static int swap_info_link(struct scsi_swap_core *core, swap_info_t *info)
+{
+    int ret;
 
-    list_for_each_entry_safe(info, next, &core->info_list, list) 
+    mutex_lock(&core->info_list_mutex);
+    ret = radix_tree_insert(&core->info_tree, SWAP_BLOCK_INDEX(core, info->table.src_sec), info);
+    if (0 == ret)
     {
-        if (NULL != info)
+        list_add_tail_rcu(&info->list, &core->info_list);
+
+        /* 第一个映射, 打开generic_make_request里的检查 */
+        if (1 == atomic_inc_return(&core->info_num))
         {
-            if (info->table.src_sec == sector) 
-            {
-                spin_unlock(&core->info_list_lock);
-                return info;
-            }
+            static_key_slow_inc(&scsi_swap_remap_key);
         }
     }
-    
-    spin_unlock(&core->info_list_lock);
-    
-    return NULL;
+    mutex_unlock(&core->info_list_mutex);
+
+    return ret;
+}
+
+/* 头只占第一个扇区, 整个物理块一起写, 其余补0, 盘内不用读改写 */
+static int swap_head_write(struct scsi_swap_core *core, sector_t sector, const struct swap_head *head)
+{
+    struct scsi_device *device = core_to_scsi_device(core);
+
+    memset(core->head_buf, 0, core->phys_sectors * SECTOR_SIZE);
+    memcpy(core->head_buf, head, SECTOR_SIZE);
+
+    return hd_write_sector_retry(device, sector, core->phys_sectors, 
+            core->head_buf, core->phys_sectors * SECTOR_SIZE);
 }
 
 /*****************************************************************************
  函 数 名  : flush_swap_head
  功能描述  : 写交换头, 整个扇区
- 输入参数  : 
+ 输入参数  : strict 为true时主头写失败也返回失败, 改版本号时用
  输出参数  : 
  返 回 值  : 0 成功 -1 失败
  调用函数  : 
@@ -260,19 +275,22 @@ static swap_info_t *swap_find_swap_info(struct scsi_swap_core *core, sector_t se
     修改内容   : 新生成函数
 
 *****************************************************************************/
-static int flush_swap_head(struct scsi_swap_core *core)
+static int flush_swap_head(struct scsi_swap_core *core, bool strict)
 {
-    struct scsi_device *device = core_to_scsi_device(core);
 	struct swap_head *head = &core->head;
+    struct scsi_swap_stats *stats = core_to_swap_stats(core);
+    ktime_t start = ktime_get();
 
     int ret = 0;
+    int master;
 
     SWAP_ASSERT(sizeof (struct swap_head) == SECTOR_SIZE);
     
     head->checksum = swap_crc32(~0, head, SECTOR_SIZE - sizeof(u32));
 
     /* 写入硬盘 */
-    ret = hd_write_sector_retry(device, core->sector_head, 1, head, SECTOR_SIZE);
+    ret = swap_head_write(core, core->sector_head, head);
+    master = ret;
     if (0 != ret)
     {
         /* 这里不返回，后面继续进行备份 */
@@ -280,19 +298,330 @@ static int flush_swap_head(struct scsi_swap_core *core)
     }
 
     /* 备份 */
-    ret = hd_write_sector_retry(device, core->sector_head + SWAP_HEAD_BACKUP_OFFEST, 1, head, SECTOR_SIZE);
+    ret = swap_head_write(core, core->sector_head + SWAP_HEAD_BACKUP_OFFEST, head);
+    swap_stat_inc(stats, SWAP_STAT_HEAD_FLUSH);
+    swap_stat_latency(stats, SWAP_LAT_HEAD_FLUSH, start);
+    trace_scsi_swap_head_flush(core_to_devt(core), ret, start);
     if (0 != ret)
     {
         SWAP_ERR("write to swap back head failed\n");
         return -1;
     }
 
+    if (strict && 0 != master)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * 写连续的num个映射表扇区, num和start按物理块对齐.
+ * 先一条命令写完, 失败时再逐个物理块写
+ * 返回: 写失败的扇区数
+ */
+static int swap_table_write(struct scsi_swap_core *core, sector_t start, char *buf, int num)
+{
+    struct scsi_device *device = core_to_scsi_device(core);
+    int unit = core->phys_sectors;
+    int err = 0;
+    int i;
+
+    if (0 == hd_write_sector_no_retry(device, start, num, buf, num * SECTOR_SIZE))
+    {
+        return 0;
+    }
+
+    /* 逐个物理块重写 */
+    for (i = 0; i < num; i += unit)
+    {
+        if (0 != hd_write_sector_retry(device, start + i, unit, buf + i * SECTOR_SIZE, unit * SECTOR_SIZE))
+        {
+            SWAP_ERR("write table sector %llu failed\n", (unsigned long long)(start + i));
+            err += unit;
+        }
+    }
+
+    return err;
+}
+
+/* 盘上表项的长度, 由头里的版本号决定 */
+static inline int swap_table_entry_len(struct scsi_swap_core *core)
+{
+    return 1 == core->table_version ? sizeof(struct swap_table) : sizeof(struct swap_table_compact);
+}
+
+/* 当前格式最多能有的映射个数 */
+static inline int swap_table_max_num(struct scsi_swap_core *core)
+{
+    return 1 == core->table_version ? MAX_SWAP_BLOCK_FOR_USE : MAX_SWAP_BLOCK;
+}
+
+/* 内存里的表项转成盘上格式 */
+static void swap_table_encode(struct scsi_swap_core *core, const struct swap_table *table, char *p)
+{
+    struct swap_table_compact *compact = (struct swap_table_compact *)p;
+
+    if (1 == core->table_version)
+    {
+        memcpy(p, table, sizeof(struct swap_table));
+        return;
+    }
+
+    compact->src_sec = table->src_sec;
+    compact->index = table->index;
+    compact->checksum = swap_crc32(~0, compact, sizeof(struct swap_table_compact) - sizeof(u32));
+}
+
+/*
+ * 盘上的表项转成内存里的表项, 0002格式的替换扇区由index算出
+ * 返回: 0 有效 1 表结束 -1 校验失败
+ */
+static int swap_table_decode(struct scsi_swap_core *core, const char *p, struct swap_table *table)
+{
+    const struct swap_table_compact *compact = (const struct swap_table_compact *)p;
+
+    if (1 == core->table_version)
+    {
+        memcpy(table, p, sizeof(struct swap_table));
+
+        /* 不等于定义的值即无效 */
+        if (table->sec_size != core->block_sectors)
+        {
+            return 1;
+        }
+
+        if (swap_crc32(~0, table, sizeof(struct swap_table) - sizeof(u32) - sizeof(sector_t)) != table->checksum)
+        {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /* 全0即表结束 */
+    if (0 == compact->src_sec && 0 == compact->index && 0 == compact->checksum)
+    {
+        return 1;
+    }
+
+    if (swap_crc32(~0, compact, sizeof(struct swap_table_compact) - sizeof(u32)) != compact->checksum
+        || compact->index >= MAX_SWAP_BLOCK)
+    {
+        return -1;
+    }
+
+    memset(table, 0, sizeof(struct swap_table));
+    table->src_sec = compact->src_sec;
+    table->index = compact->index;
+    table->sec_size = core->block_sectors;
+    table->swap_sec = core->sector_data + SWAP_BLOCK_SECTOR(core, table->index);
+    table->checksum = swap_crc32(~0, table, sizeof(struct swap_table) - sizeof(u32) - sizeof(sector_t));
+
+    return 0;
+}
+
+/* 按info_list顺序生成整张映射表, 每个扇区SECTOR_SIZE/swap_table_entry_len个 */
+static void swap_table_build(struct scsi_swap_core *core, char *buf)
+{
+    struct swap_info *entry;
+    int len = swap_table_entry_len(core);
+    int table_num = SECTOR_SIZE/len;
+    int i = 0;
+
+    memset(buf, 0, SWPA_TABLE_N_SECTOR * SECTOR_SIZE);
+
+    mutex_lock(&core->info_list_mutex);
+    list_for_each_entry(entry, &core->info_list, list)
+    {
+        if (i >= SWPA_TABLE_N_SECTOR * table_num)
+        {
+            break;
+        }
+
+        /* 映射表所在的扇区号，只记录主映射表，备份映射表可计算得到 */
+        entry->table.save_sec = core->sector_table + i / table_num;
+        swap_table_encode(core, &entry->table, buf + i * len);
+        i++;
+    }
+    mutex_unlock(&core->info_list_mutex);
+}
+
+/*
+ * 映射表和头落盘, 只写和盘上内容不同的扇区.
+ * 先刷头再刷表, 表里引用的块在头的bitmap里一定已经置位.
+ * 多个新建映射之后调用一次即可, 并发调用时后来者发现
+ * 已经没有变化, 直接返回.
+ * 返回: 0 成功 -1 失败
+ */
+static int swap_table_commit(struct scsi_swap_core *core)
+{
+    sector_t sect_back = core->sector_reserve_start + SWAP_TABLE_BACKUP_OFFSET;
+    char *buf;
+    char *disk;
+    int unit = core->phys_sectors;
+    int err;
+    int err_back;
+    int ret = 0;
+    int i;
+    int n;
+    struct scsi_swap_stats *stats = core_to_swap_stats(core);
+    ktime_t start = ktime_get();
+
+    mutex_lock(&core->commit_mutex);
+
+    /* 先生成表再比较头, 表里的块都是在加入链表前分配的 */
+    swap_table_build(core, core->table_buf);
+
+    mutex_lock(&core->bitmap_mutex);
+    if (core->head_stale
+        || 0 != memcmp(core->head_disk_bitmap, core->head.bitmap, sizeof(core->head.bitmap)))
+    {
+        /* 头的版本号没写好之前不能按当前版本写表 */
+        if (0 != flush_swap_head(core, core->head_stale))
+        {
+            mutex_unlock(&core->bitmap_mutex);
+            SWAP_ERR("flush_swap_head fail\n");
+            ret = -1;
+            goto out;
+        }
+        memcpy(core->head_disk_bitmap, core->head.bitmap, sizeof(core->head.bitmap));
+        core->head_stale = false;
+    }
+    mutex_unlock(&core->bitmap_mutex);
+
+    /* 连续的变化物理块一条命令写, 主备各一次 */
+    for (i = 0; i < SWPA_TABLE_N_SECTOR; i += n)
+    {
+        buf = core->table_buf + i * SECTOR_SIZE;
+        disk = core->table_disk + i * SECTOR_SIZE;
+        for (n = 0; i + n < SWPA_TABLE_N_SECTOR; n += unit)
+        {
+            if (0 == memcmp(buf + n * SECTOR_SIZE, disk + n * SECTOR_SIZE, unit * SECTOR_SIZE))
+            {
+                break;
+            }
+        }
+
+        if (0 == n)
+        {
+            n = unit;
+            continue;
+        }
+
+        err = swap_table_write(core, core->sector_table + i, buf, n);
+        if (0 != err)
+        {
+            SWAP_ERR("flush master table %d, %d failed\n", i, n);
+        }
+
+        err_back = swap_table_write(core, sect_back + i, buf, n);
+        if (0 != err_back)
+        {
+            SWAP_ERR("flush backup table %d, %d failed\n", i, n);
+        }
+
+        /* 主备都写成功才算干净, 否则下次提交重写 */
+        if (0 == err && 0 == err_back)
+        {
+            memcpy(disk, buf, n * SECTOR_SIZE);
+        }
+        else if (0 != err && 0 != err_back)
+        {
+            ret = -1;
+        }
+    }
+
+out:
+    mutex_unlock(&core->commit_mutex);
+    swap_stat_inc(stats, SWAP_STAT_TABLE_FLUSH);
+    swap_stat_latency(stats, SWAP_LAT_TABLE_FLUSH, start);
+    trace_scsi_swap_table_commit(core_to_devt(core), ret, start);
+    return ret;
+}
+
+/*
+ * 0001格式的映射表在线升级为0002格式.
+ * 顺序是主表, 头, 备表: 头还是0001时0002的主表解析不出表项,
+ * 会用备表; 头改成0002后旧的备表解析不出表项, 会用主表.
+ * 按这个顺序掉电, 重启后能读到完整的映射表.
+ * 写头出错时主备两个头可能一个0002一个0001, 所以两个头
+ * 都写成功才算升级; 否则把两个头都改回0001, 改不回来就
+ * 置head_stale, 下次提交先重写头, 头写好之前不写表.
+ * 返回: 0 成功 -1 失败, 失败时继续用0001格式
+ */
+static int swap_table_upgrade(struct scsi_swap_core *core)
+{
+    sector_t sect_back = core->sector_reserve_start + SWAP_TABLE_BACKUP_OFFSET;
+    int ret;
+
+    mutex_lock(&core->commit_mutex);
+
+    core->table_version = 2;
+    swap_table_build(core, core->table_buf);
+
+    if (0 != swap_table_write(core, core->sector_table, core->table_buf, SWPA_TABLE_N_SECTOR))
+    {
+        SWAP_ERR("write master table failed\n");
+        goto fail;
+    }
+
+    mutex_lock(&core->bitmap_mutex);
+    strncpy((char *)core->head.version, SWAP_VERSION, SWAP_HEAD_VERSION_LEN);
+    ret = flush_swap_head(core, true);
+    if (0 == ret)
+    {
+        memcpy(core->head_disk_bitmap, core->head.bitmap, sizeof(core->head.bitmap));
+        core->head_stale = false;
+    }
+    else
+    {
+        strncpy((char *)core->head.version, SWAP_VERSION_0001, SWAP_HEAD_VERSION_LEN);
+        if (0 == flush_swap_head(core, true))
+        {
+            memcpy(core->head_disk_bitmap, core->head.bitmap, sizeof(core->head.bitmap));
+            core->head_stale = false;
+        }
+        else
+        {
+            SWAP_ERR("restore swap head version failed\n");
+            core->head_stale = true;
+        }
+    }
+    mutex_unlock(&core->bitmap_mutex);
+
+    if (0 != ret)
+    {
+        SWAP_ERR("flush_swap_head fail\n");
+        goto fail;
+    }
+
+    /* 备表写失败时当作盘上没有表, 下次提交主备全部重写 */
+    if (0 != swap_table_write(core, sect_back, core->table_buf, SWPA_TABLE_N_SECTOR))
+    {
+        SWAP_ERR("write backup table failed\n");
+        memset(core->table_disk, 0, SWPA_TABLE_N_SECTOR * SECTOR_SIZE);
+    }
+    else
+    {
+        memcpy(core->table_disk, core->table_buf, SWPA_TABLE_N_SECTOR * SECTOR_SIZE);
+    }
+
+    mutex_unlock(&core->commit_mutex);
     return 0;
+
+fail:
+    /* 主表可能已经写了一部分0002, 提交时按0001全部重写 */
+    core->table_version = 1;
+    memset(core->table_disk, 0, SWPA_TABLE_N_SECTOR * SECTOR_SIZE);
+    mutex_unlock(&core->commit_mutex);
+    return -1;
 }
 
 /*****************************************************************************
  函 数 名  : swap_check_block_by_sector
- 功能描述  : 检测一个block是否有坏扇区，一个扇区一个扇区测
+ 功能描述  : 检测一个block是否有坏扇区，一个物理块一个物理块测
  输入参数  : 
  输出参数  : 
  返 回 值  : 0 成功 -1 失败
@@ -305,17 +634,16 @@ static int flush_swap_head(struct scsi_swap_core *core)
     修改内容   : 新生成函数
 
 *****************************************************************************/
-static int swap_check_block_by_sector(struct scsi_device *sdev, sector_t sec_start, int *bad_index)
+static int swap_check_block_by_sector(struct scsi_swap_core *core, sector_t sec_start, int *bad_index)
 {
-    char buffer[SECTOR_SIZE] = {0};
+    struct scsi_device *sdev = core_to_scsi_device(core);
+    int unit = core->phys_sectors;
     int i = 0;
 
-    memset(buffer, 0 , sizeof(buffer));
-
-    // 一个扇区一个扇区写0进行初始化
-    for (i = 0; i < SECTOR_NUM_PER_SWAP_BLOCK; i++)
+    // 一个物理块一个物理块写0进行初始化
+    for (i = 0; i < SECTOR_NUM_PER_SWAP_BLOCK; i += unit)
     {
-        if(0 != hd_write_sector_retry(sdev, (sector_t)(sec_start + i), 1, buffer, sizeof(buffer)))
+        if(0 != hd_write_sector_retry(sdev, (sector_t)(sec_start + i), unit, core->zero_block, unit * SECTOR_SIZE))
         {
             /* 只要有一个坏扇区，该block不可用 */
             SWAP_ERR("new head has bad block(sec %d write 0 error)\n", i);
@@ -342,28 +670,16 @@ static int swap_check_block_by_sector(struct scsi_device *sdev, sector_t sec_sta
     修改内容   : 新生成函数
 
 *****************************************************************************/
-static int swap_check_block(struct scsi_device *sdev, sector_t sec_start)
+static int swap_check_block(struct scsi_swap_core *core, sector_t sec_start)
 {
-    char * buffer = NULL;
-
-    size_t block_size = SECTOR_SIZE*SECTOR_NUM_PER_SWAP_BLOCK;
-
-    buffer = kmalloc(block_size, GFP_KERNEL);
-    if (NULL == buffer)
-    {
-        SWAP_ERR("kmalloc fail\n");
-        return -1;
-    }
+    struct scsi_device *sdev = core_to_scsi_device(core);
 
-    memset(buffer, 0 , block_size);
-    if(0 != hd_write_sector_retry(sdev, sec_start , SECTOR_NUM_PER_SWAP_BLOCK, buffer, block_size))
+    /* 用预分配的全0块, 映射路径上不再分配块缓冲 */
+    if(0 != hd_write_sector_retry(sdev, sec_start , core->block_sectors, core->zero_block, SWAP_BLOCK_SIZE(core)))
     {
         SWAP_ERR("sector %llu write 0 fail\n", (unsigned long long)sec_start);
-        kfree(buffer);
         return -1;
     }
-    
-    kfree(buffer);
 
     return 0;
 }
@@ -390,7 +706,7 @@ static int _swap_create_new_head(struct scsi_swap_core *core)
     strncpy((char *)head->head_string, SWAP_HEAD_STRING, 16);
     strncpy((char *)head->version, SWAP_VERSION, 4);
 
-    return flush_swap_head(core);
+    return flush_swap_head(core, false);
 }
 
 
@@ -414,15 +730,25 @@ static int swap_create_new_head(struct scsi_swap_core *core)
     int ret = 0;
     int i = 0;
     int bad_index = 0;
-	struct scsi_device *device = core_to_scsi_device(core);
 	struct swap_head *head = &core->head;
 
     memset(head, 0, sizeof(struct swap_head));
 
+    /* 替换块大小在格式化时确定, 以后不能再改 */
+    if (swap_block_sectors_valid(swap_block_sectors))
+    {
+        head->block_sectors = swap_block_sectors;
+    }
+    else
+    {
+        SWAP_ERR("invalid swap_block_sectors %u, use %d\n", swap_block_sectors, SECTOR_NUM_PER_SWAP_BLOCK);
+        head->block_sectors = SECTOR_NUM_PER_SWAP_BLOCK;
+    }
+
     for (i = 0; i < MAX_SWAP_HEAD_BLOCK_NUM; i++)
     {
         /* 检查该block有没有坏块 */
-        ret = swap_check_block_by_sector(device, core->sector_head, &bad_index);
+        ret = swap_check_block_by_sector(core, core->sector_head, &bad_index);
         if (0 == ret)
         {
             strncpy((char *)head->status, "valid", 5);
@@ -470,21 +796,19 @@ static int swap_create_new_head(struct scsi_swap_core *core)
 static bool _did_block_swapped(struct scsi_swap_core *core, sector_t sector, int count)
 {
     sector_t end = sector + count;
-    sector_t start = SWAP_SECTOR_ALIGN(sector);
-    bool ret = false;
-
-    for (; start < end; start += SECTOR_NUM_PER_SWAP_BLOCK) {
-        if (NULL != swap_find_swap_info(core, start)) {
-            ret = true;
-            SWAP_DEBUG("sector = %llu, count = %d, start = %llu, end = %llu, return: true\n", 
-					(unsigned long long)sector, count, 
-					(unsigned long long)start, 
-					(unsigned long long)end);
-            break;
-        }
+    sector_t start = SWAP_SECTOR_ALIGN(core, sector);
+
+    if (NULL == swap_find_first_swap_info(core, start, end))
+    {
+        return false;
     }
 
-    return ret;
+    SWAP_DEBUG("sector = %llu, count = %d, start = %llu, end = %llu, return: true\n", 
+                (unsigned long long)sector, count, 
+                (unsigned long long)start, 
+                (unsigned long long)end);
+
+    return true;
 }
 
 /*****************************************************************************
@@ -502,11 +826,11 @@ static bool _did_block_swapped(struct scsi_swap_core *core, sector_t sector, int
     修改内容   : 新生成函数
 
 *****************************************************************************/
-static swap_info_t *_swap_alloc_info(void)
+static swap_info_t *_swap_alloc_info(struct scsi_swap_core *core)
 {
     swap_info_t *info = NULL;
     
-    info = (swap_info_t *)kmalloc(sizeof(swap_info_t), GFP_KERNEL);
+    info = (swap_info_t *)kmalloc(sizeof(swap_info_t), GFP_NOIO);
     if(info == NULL)
     {
         SWAP_ERR("kmalloc fail\n");
@@ -514,8 +838,9 @@ static swap_info_t *_swap_alloc_info(void)
     }
     
     memset (info, 0, sizeof(swap_info_t));
+    INIT_LIST_HEAD(&info->lru);
 
-    info->data = kmalloc(SWAP_BLOCK_SIZE, GFP_KERNEL);
+    info->data = kmalloc(SWAP_BLOCK_SIZE(core), GFP_NOIO);
     if(NULL == info->data)
     {
         SWAP_ERR("kmalloc fail\n");
@@ -523,7 +848,7 @@ static swap_info_t *_swap_alloc_info(void)
         return NULL;
     }
     
-    memset(info->data, 0, SWAP_BLOCK_SIZE);
+    memset(info->data, 0, SWAP_BLOCK_SIZE(core));
 
     return info;
 }
@@ -560,12 +885,99 @@ static void _swap_dealloc_info(swap_info_t *info)
     return;
 }
 
-/*****************************************************************************
- 函 数 名  : _swap_alloc_new_block
- 功能描述  : 根据bitmap，分配一个可用的映射块
- 输入参数  : 
- 输出参数  : 
- 返 回 值  : 成功映射块的index 失败返回-1
+static void _swap_dealloc_info_rcu_cb(struct rcu_head *rcu)
+{
+    _swap_dealloc_info(container_of(rcu, swap_info_t, rcu));
+}
+
+/* 释放已经发布过的swap_info_t, 等RCU读者退出 */
+static void _swap_dealloc_info_rcu(swap_info_t *info)
+{
+    call_rcu(&info->rcu, _swap_dealloc_info_rcu_cb);
+}
+
+/*
+ * 映射块数据的LRU缓存, 最多cache_max块. 只在本盘的有序swap_bio队列里访问,
+ * 不需要加锁. 正在读入的块在读完后才加入链表, 不会被挤出.
+ */
+
+/* 释放一块缓存, 预留块被用掉时先补回预留 */
+static void swap_cache_put_buf(struct scsi_swap_core *core, char *data)
+{
+    if (NULL == core->cache_spare)
+    {
+        core->cache_spare = data;
+        return;
+    }
+
+    kfree(data);
+}
+
+/* 
+ * 取一块缓存: 没到上限时分配, 到了上限或分配失败时挤出最久没用的块,
+ * 都没有时用预留块, 保证内存紧张时映射IO也能继续
+ */
+static char *swap_cache_get_buf(struct scsi_swap_core *core)
+{
+    swap_info_t *victim;
+    char *data = NULL;
+
+    if (core->cache_num < core->cache_max)
+    {
+        data = kmalloc(SWAP_BLOCK_SIZE(core), GFP_NOIO);
+        if (NULL != data)
+        {
+            return data;
+        }
+    }
+
+    if (list_empty(&core->cache_lru))
+    {
+        data = core->cache_spare;
+        core->cache_spare = NULL;
+        return data;
+    }
+
+    victim = list_entry(core->cache_lru.prev, swap_info_t, lru);
+    list_del_init(&victim->lru);
+    data = victim->data;
+    victim->data = NULL;
+    core->cache_num--;
+
+    return data;
+}
+
+/* info->data已经是完整的块数据, 加入缓存, 超过上限时释放最久没用的块 */
+static void swap_cache_add(struct scsi_swap_core *core, swap_info_t *info)
+{
+    swap_info_t *victim;
+
+    list_add(&info->lru, &core->cache_lru);
+    core->cache_num++;
+
+    while (core->cache_num > core->cache_max)
+    {
+        victim = list_entry(core->cache_lru.prev, swap_info_t, lru);
+        list_del_init(&victim->lru);
+        swap_cache_put_buf(core, victim->data);
+        victim->data = NULL;
+        core->cache_num--;
+    }
+}
+
+/* 缓存命中, 移到最前 */
+static inline void swap_cache_touch(struct scsi_swap_core *core, swap_info_t *info)
+{
+    list_move(&info->lru, &core->cache_lru);
+    atomic64_inc(&core->cache_hit);
+}
+
+/*****************************************************************************
+ 函 数 名  : _swap_alloc_new_block
+ 功能描述  : 根据bitmap，分配一个可用的映射块
+ 输入参数  : 
+ 输出参数  : 
+ 返 回 值  : 成功映射块的index 失败返回-1
  调用函数  : 
  被调函数  : 
  
@@ -580,7 +992,6 @@ static int _swap_alloc_new_block(struct scsi_swap_core *core)
     int index = 0;
     int err_cnt = 0;
 	struct swap_head *head = &core->head;
-	struct scsi_device *device = core_to_scsi_device(core);
 
     index = swap_head_bitmap_get_first_zero_bit(head);
     
@@ -591,7 +1002,7 @@ static int _swap_alloc_new_block(struct scsi_swap_core *core)
     }
 
     /* 检测被映射block是否可用 */
-    while(0 != swap_check_block(device, core->sector_data + SECTOR_NUM_PER_SWAP_BLOCK * index))
+    while(0 != swap_check_block(core, core->sector_data + SWAP_BLOCK_SECTOR(core, index)))
     {
         if (err_cnt++ >= 16)
         {
@@ -638,9 +1049,9 @@ static int _swap_create(struct scsi_swap_core *core, swap_info_t *info, sector_t
     int back_len;
     int index = 0;
 
-    spin_lock(&core->bitmap_lock);
+    mutex_lock(&core->bitmap_mutex);
     index = _swap_alloc_new_block(core);
-    spin_unlock(&core->bitmap_lock);
+    mutex_unlock(&core->bitmap_mutex);
     
     if(-1 == index)
     {
@@ -648,16 +1059,16 @@ static int _swap_create(struct scsi_swap_core *core, swap_info_t *info, sector_t
         return -1;
     }
 
-    if(need_zero_offset + need_zero_len > SECTOR_NUM_PER_SWAP_BLOCK)
+    if(need_zero_offset + need_zero_len > core->block_sectors)
     {
         SWAP_ERR("invaild param\n");
-        need_zero_len = SECTOR_NUM_PER_SWAP_BLOCK - need_zero_offset;
+        need_zero_len = core->block_sectors - need_zero_offset;
     }
 
     front_len = need_zero_offset;
-    back_len = SECTOR_NUM_PER_SWAP_BLOCK - (need_zero_offset + need_zero_len);
+    back_len = core->block_sectors - (need_zero_offset + need_zero_len);
 
-    SWAP_ERR("created a swap %llu, %d\n", (unsigned long long)src, 128);
+    SWAP_ERR("created a swap %llu, %u\n", (unsigned long long)src, core->block_sectors);
 
     if (front_len > 0)
     {
@@ -685,9 +1096,9 @@ static int _swap_create(struct scsi_swap_core *core, swap_info_t *info, sector_t
     }
 
     info->table.src_sec = src;
-    info->table.sec_size = SECTOR_NUM_PER_SWAP_BLOCK;
+    info->table.sec_size = core->block_sectors;
     info->table.index = index;
-    info->table.swap_sec = core->sector_data + SECTOR_NUM_PER_SWAP_BLOCK * info->table.index;
+    info->table.swap_sec = core->sector_data + SWAP_BLOCK_SECTOR(core, info->table.index);
     info->table.checksum = swap_crc32(~0, &info->table, sizeof(struct swap_table) - sizeof(u32) - sizeof(sector_t));
 
     return 0;
@@ -709,7 +1120,7 @@ static int _swap_create(struct scsi_swap_core *core, swap_info_t *info, sector_t
     修改内容   : 新生成函数
 
 *****************************************************************************/
-static int _swap_read(struct scsi_swap_core *core, swap_info_t *info, sector_t sector_start, int sector_count, char *buf, int buf_size)
+static int _swap_read(struct scsi_swap_core *core, swap_info_t *info, sector_t sector_start, int sector_count, struct swap_sg *sg)
 {
     sector_t sector_src;
     int data_offset;
@@ -720,13 +1131,11 @@ static int _swap_read(struct scsi_swap_core *core, swap_info_t *info, sector_t s
         return -1;
     }
 
-    sector_src = SWAP_SECTOR_ALIGN(sector_start);
+    sector_src = SWAP_SECTOR_ALIGN(core, sector_start);
     data_offset = (sector_start-sector_src)*SECTOR_SIZE;
-    buf_size = min((int)sector_count*SECTOR_SIZE, buf_size);
-
-    memcpy(buf, info->data + data_offset, buf_size);
 
-    //buf_show("_swap_read", info->data, buf_size);
+    // 直接复制到bio的页面
+    swap_sg_from_buf(sg, info->data + data_offset, sector_count*SECTOR_SIZE);
 
     return 0;
 }
@@ -747,9 +1156,9 @@ static int _swap_read(struct scsi_swap_core *core, swap_info_t *info, sector_t s
     修改内容   : 新生成函数
 
 *****************************************************************************/
-static int _swap_write(struct scsi_swap_core *core, swap_info_t *info, sector_t sector_start, int sector_count, const char *buf, int buf_size)
+static int _swap_write(struct scsi_swap_core *core, swap_info_t *info, sector_t sector_start, int sector_count, struct swap_sg *sg)
 {
-    u32 sector_src;
+    sector_t sector_src;
     int data_offset;
 
     if(NULL == info)
@@ -758,20 +1167,19 @@ static int _swap_write(struct scsi_swap_core *core, swap_info_t *info, sector_t
         return -1;
     }
 
-    sector_src = SWAP_SECTOR_ALIGN(sector_start);
+    sector_src = SWAP_SECTOR_ALIGN(core, sector_start);
     data_offset = (sector_start-sector_src)*SECTOR_SIZE;
-    buf_size = min((int)sector_count*SECTOR_SIZE, buf_size);
 
-    // 更新交换块BUF
-    memcpy(info->data + data_offset, buf, buf_size);
+    // 更新交换块BUF, 直接从bio的页面复制
+    swap_sg_to_buf(sg, info->data + data_offset, sector_count*SECTOR_SIZE);
 
     //buf_show("after _swap_write", info->data, 65536);
 
-    // 更新映射块
+    // 更新映射块, 只写改过的扇区
 
-    if (0 != flush_swap_info_data(core, info))
+    if (0 != flush_swap_info_range(core, info, data_offset / SECTOR_SIZE, sector_count))
     {
-        SWAP_ERR("flush_swap_info_data fail\n");
+        SWAP_ERR("flush_swap_info_range fail\n");
         return -1;
     }
 
@@ -801,17 +1209,17 @@ static swap_info_t *swap_create(struct scsi_swap_core *core, sector_t sector_sta
 	int fail_reason = -1;
 	struct scsi_swap_log *log;
 
-    /* 最大支持MAX_SWAP_BLOCK_FOR_USE(128)个映射 */
-    if (atomic_read(&core->info_num) >= MAX_SWAP_BLOCK_FOR_USE)
+    /* 0001格式最大支持MAX_SWAP_BLOCK_FOR_USE(128)个映射, 0002格式整个数据区 */
+    if (atomic_read(&core->info_num) >= swap_table_max_num(core))
     {
         SWAP_ERR("no more reserved block for swap\n");
 		fail_reason = LOG_FAILED_CREATE_MAXCOUNT;
 		goto out;
     }
 
-    sector_bswap = SWAP_SECTOR_ALIGN(sector_start);
+    sector_bswap = SWAP_SECTOR_ALIGN(core, sector_start);
 
-    info = _swap_alloc_info();
+    info = _swap_alloc_info(core);
     if (NULL == info)
     {
         SWAP_ERR("error: no memory to alloc info\n");
@@ -829,19 +1237,17 @@ static swap_info_t *swap_create(struct scsi_swap_core *core, sector_t sector_sta
 		goto out;
     }
 
-    ret = flush_swap_head(core);
-    if (0 != ret)
-    {
-        SWAP_ERR("flush_swap_head fail\n");
-        swap_bitmap_set_bit((unsigned long *)core->head.bitmap, (int)info->table.index, 0);
-        _swap_dealloc_info(info);
-		info = NULL;
-		fail_reason = LOG_FAILED_CREATE_FLUSH_HEAD; 
-		goto out;
-    }
+    /* 头和映射表由调用者在加入链表后用swap_table_commit一起落盘 */
 
 out:
 	log  = &(core_to_swap_handler(core)->log);
+	swap_stat_inc(core_to_swap_stats(core), 
+			info == NULL ? SWAP_STAT_CREATE_FAIL : SWAP_STAT_CREATE);
+	trace_scsi_swap_create(core_to_devt(core), 
+			info == NULL ? sector_start : info->table.src_sec, 
+			info == NULL ? sector_count : info->table.sec_size, 
+			info == NULL ? -1 : info->table.swap_sec, 
+			info == NULL ? fail_reason : 0);
 
 	scsi_swap_log_push(log, LOG_TYPE_CREATE, LOG_RESULT(fail_reason), 
 			info == NULL ? sector_start : info->table.src_sec, 
@@ -870,67 +1276,94 @@ static int swap_recreate(struct scsi_swap_core *core, swap_info_t *info)
 {
     int i = 0;
     int index = 0;
+    int ret = -1;
+    struct swap_table old_table = info->table;
 	struct scsi_device *sdev = core_to_scsi_device(core);
+    int unit = max(sdev->sector_size, (unsigned)SECTOR_SIZE) / SECTOR_SIZE;
     
-    /* 最大支持MAX_SWAP_BLOCK_FOR_USE(128)个映射 */
-    if (atomic_read(&core->info_num) >= MAX_SWAP_BLOCK_FOR_USE)
+    /* 0001格式最大支持MAX_SWAP_BLOCK_FOR_USE(128)个映射, 0002格式整个数据区 */
+    if (atomic_read(&core->info_num) >= swap_table_max_num(core))
     {
         SWAP_ERR("no more reserved blocks for swap\n");
-        return -1;
+        goto out;
     }
 
-    spin_lock(&core->bitmap_lock);
+    mutex_lock(&core->bitmap_mutex);
     index = _swap_alloc_new_block(core);
-    spin_unlock(&core->bitmap_lock);
+    mutex_unlock(&core->bitmap_mutex);
 
     if(-1 == index)
     {
         SWAP_ERR("no reserved space left\n");
-        return -1;
+        goto out;
     }
 
-    /* 为了尽量保持数据完整，按扇区进行读取 */
-    for (i = 0; i < SECTOR_NUM_PER_SWAP_BLOCK; i++)
+    /* 为了尽量保持数据完整，按逻辑块进行读取, 4Kn盘上不能按512字节读 */
+    for (i = 0; i < info->table.sec_size; i += unit)
     {
-        if(0 != hd_read_sector_no_retry(sdev, info->table.swap_sec + i, 1, 
-                    info->data + i * SECTOR_SIZE, SECTOR_SIZE))
+        if(0 != hd_read_sector_no_retry(sdev, info->table.swap_sec + i, unit, 
+                    info->data + i * SECTOR_SIZE, unit * SECTOR_SIZE))
         {
             /* 读出错，数据清零 */
             //SWAP_ERR("read (%llu, %d) failed\n", info->table.swap_sec + i, SECTOR_SIZE);
-            memset(info->data + i*SECTOR_SIZE, 0, SECTOR_SIZE);
+            memset(info->data + i*SECTOR_SIZE, 0, unit * SECTOR_SIZE);
         }
     }    
 
-    /* 更新映射扇区信息 */
+    /* 更新映射扇区信息, 加锁防止table_bin读到一半 */
+    mutex_lock(&core->info_list_mutex);
     info->table.index = index;
-    info->table.swap_sec = core->sector_data + SECTOR_NUM_PER_SWAP_BLOCK * info->table.index;
+    info->table.swap_sec = core->sector_data + SWAP_BLOCK_SECTOR(core, info->table.index);
     info->table.checksum = swap_crc32(~0, &info->table, sizeof(struct swap_table) - sizeof(u32) - sizeof(sector_t));
+    mutex_unlock(&core->info_list_mutex);
 
-    // 更新目标数据
+    // 更新目标数据, 头和映射表由调用者用swap_table_commit落盘
     if (0 != flush_swap_info_data(core, info))
     {
         SWAP_ERR("flush_swap_info_data fail\n");
         goto err;
     }
 
-    if (0 != flush_swap_info_table(core))
+    ret = 0;
+    goto out;
+err:
+    // 恢复原来的映射, 释放新分配的块
+    mutex_lock(&core->info_list_mutex);
+    info->table = old_table;
+    mutex_unlock(&core->info_list_mutex);
+    mutex_lock(&core->bitmap_mutex);
+    swap_bitmap_set_bit((unsigned long *)core->head.bitmap, index, 0);
+    mutex_unlock(&core->bitmap_mutex);
+out:
+    trace_scsi_swap_recreate(core_to_devt(core), old_table.src_sec, 
+            old_table.swap_sec, info->table.swap_sec, ret);
+    return ret;
+    
+}
+
+/* 同步读入一个没有缓存的映射块, 读失败时重建映射 */
+static int swap_cache_load(struct scsi_swap_core *core, swap_info_t *info)
+{
+	struct scsi_device *sdev = core_to_scsi_device(core);
+
+    info->data = swap_cache_get_buf(core);
+    if (NULL == info->data)
     {
-        SWAP_ERR("flush_swap_info_table fail\n");
-        goto err;
+        SWAP_ERR("no memory for swap cache\n");
+        return -1;
     }
 
-    if (0 != flush_swap_head(core))
+    if (0 != hd_read_sector_retry(sdev, info->table.swap_sec, info->table.sec_size, 
+                info->data, info->table.sec_size * SECTOR_SIZE)
+            && 0 != swap_recreate(core, info))
     {
-        SWAP_ERR("flush_swap_head fail\n");
-        goto err;
+        swap_cache_put_buf(core, info->data);
+        info->data = NULL;
+        return -1;
     }
 
+    swap_cache_add(core, info);
     return 0;
-err:
-    // 更新头
-    swap_bitmap_set_bit((unsigned long *)core->head.bitmap, index, 0);
-    return -1;
-    
 }
 
 /*****************************************************************************
@@ -948,9 +1381,15 @@ err:
     修改内容   : 新生成函数
 
 *****************************************************************************/
-static int swap_write(struct scsi_swap_core *core, swap_info_t *info, sector_t sector_start, int sector_count, const char *buf, int buf_size)
+static int swap_write(struct scsi_swap_core *core, swap_info_t *info, sector_t sector_start, int sector_count, struct swap_sg *sg)
 {
-    if (0 == _swap_write(core, info, sector_start, sector_count, buf, buf_size))
+    /* 部分写也要先有整块数据 */
+    if (NULL == info->data && 0 != swap_cache_load(core, info))
+    {
+        return -1;
+    }
+
+    if (0 == _swap_write(core, info, sector_start, sector_count, sg))
     {
         return 0;
     }
@@ -962,7 +1401,7 @@ static int swap_write(struct scsi_swap_core *core, swap_info_t *info, sector_t s
         return -1;
     }
     
-    if (0 != _swap_write(core, info, sector_start, sector_count, buf, buf_size))
+    if (0 != _swap_write(core, info, sector_start, sector_count, sg))
     {
         SWAP_ERR("_swap_write fail\n");
         return -1;
@@ -1009,15 +1448,19 @@ static inline int swap_head_exist (struct swap_head *head)
     修改内容   : 新生成函数
 
 *****************************************************************************/
-static swap_head_state_e swap_get_head_state(struct scsi_device *scsidev, sector_t sector, 
-    u32 sec_num, struct swap_head *head)
+static swap_head_state_e swap_get_head_state(struct scsi_swap_core *core, sector_t sector, 
+    struct swap_head *head)
 {
-    /* 读取 */
-    if (0 != hd_read_sector_retry(scsidev, sector, sec_num, (char *)head, SECTOR_SIZE)) 
+    struct scsi_device *scsidev = core_to_scsi_device(core);
+
+    /* 读取整个物理块, 头在第一个扇区 */
+    if (0 != hd_read_sector_retry(scsidev, sector, core->phys_sectors, core->head_buf, 
+                core->phys_sectors * SECTOR_SIZE)) 
     {
         /* 坏扇区 */
         return HEAD_FAIL;
     }
+    memcpy(head, core->head_buf, SECTOR_SIZE);
     
     /* 无HWSWAP标识，没写过，或者已损坏 */
     if (!swap_head_exist(head))
@@ -1162,7 +1605,6 @@ static int swap_repair_successive_sectors(struct scsi_device *device, sector_t s
 *****************************************************************************/
 static int init_swap_head(struct scsi_swap_core *core, sector_t start, u32 num)
 {
-	struct scsi_device *device = core_to_scsi_device(core);
     struct swap_head *head = &core->head;
     char head_back[SECTOR_SIZE] = {0};
     sector_t sec_start = 0;
@@ -1177,7 +1619,7 @@ static int init_swap_head(struct scsi_swap_core *core, sector_t start, u32 num)
         sec_start = start + i*SECTOR_NUM_PER_SWAP_BLOCK;
 
         /* 获取主扇区状态 */
-        head_state = swap_get_head_state(device, sec_start, 1, head);
+        head_state = swap_get_head_state(core, sec_start, head);
         
         /* block中有坏扇区 */
         if (HEAD_INVALID == head_state)
@@ -1186,7 +1628,7 @@ static int init_swap_head(struct scsi_swap_core *core, sector_t start, u32 num)
         }
 
         /* 获取备份扇区状态 */
-        head_back_state = swap_get_head_state(device, sec_start + SWAP_HEAD_BACKUP_OFFEST, 1, (struct swap_head *)head_back);
+        head_back_state = swap_get_head_state(core, sec_start + SWAP_HEAD_BACKUP_OFFEST, (struct swap_head *)head_back);
         if ((HEAD_FAIL == head_state) && (HEAD_FAIL == head_back_state))
         {
             continue;
@@ -1200,7 +1642,7 @@ static int init_swap_head(struct scsi_swap_core *core, sector_t start, u32 num)
             {
                 SWAP_ERR("back head fail\n");
                 /* 备份 */
-                ret = hd_write_sector_retry(device, sec_start + SWAP_HEAD_BACKUP_OFFEST, 1, head, SECTOR_SIZE);
+                ret = swap_head_write(core, sec_start + SWAP_HEAD_BACKUP_OFFEST, head);
                 if (0 != ret)
                 {
                     SWAP_ERR("write to swap back head failed\n");
@@ -1217,7 +1659,7 @@ static int init_swap_head(struct scsi_swap_core *core, sector_t start, u32 num)
             SWAP_ERR("back head ok\n");
             memcpy(head, head_back, SECTOR_SIZE);
             /* 修复 */
-            ret = hd_write_sector_retry(device, sec_start, 1, head, SECTOR_SIZE);
+            ret = swap_head_write(core, sec_start, head);
             if (0 != ret)
             {
                 SWAP_ERR("repair swap head failed\n");
@@ -1249,56 +1691,43 @@ static int init_swap_head(struct scsi_swap_core *core, sector_t start, u32 num)
 }
 
 
-/*****************************************************************************
- 函 数 名  : alloc_swap_info_data
- 功能描述  : 分配映射的数据空间, 并读取交换块备份
- 输入参数  : 
- 输出参数  : 
- 返 回 值  : 成功返回指向数据的指针  失败返回NULL
- 调用函数  : 
- 被调函数  : 
- 
- 修改历史      :
-  1.日    期   : 2012年10月25日
-    作    者   : mincore@163.com
-    修改内容   : 新生成函数
-
-*****************************************************************************/
-static char *alloc_swap_info_data(struct scsi_device *device, sector_t start, u32 num)
+/*
+ * 读整个映射表区, 先一条命令读完, 失败时再逐个物理块读.
+ * 读不出的扇区清0, 并在bad中置位
+ * 返回: 0 成功 -1 有扇区读失败
+ */
+static int swap_table_read(struct scsi_swap_core *core, sector_t start, char *buf, unsigned long *bad)
 {
-    u32 nbytes = num * SECTOR_SIZE;
-    char *data = kmalloc(nbytes, GFP_KERNEL);
+    struct scsi_device *device = core_to_scsi_device(core);
+    int unit = core->phys_sectors;
+    int ret = 0;
+    int i;
 
-    if (NULL == data) 
+    bitmap_zero(bad, SWPA_TABLE_N_SECTOR);
+
+    /* 整块读不重试, 有坏扇区时马上改为逐个物理块读 */
+    if (0 == hd_read_sector_no_retry(device, start, SWPA_TABLE_N_SECTOR, 
+                buf, SWPA_TABLE_N_SECTOR * SECTOR_SIZE))
     {
-        SWAP_ERR("nbytes %u\n", nbytes);
-        return NULL;
+        return 0;
     }
 
-    memset (data, 0, nbytes);
-
-    //SWAP_ERR("\n");
-    if (0 != hd_read_sector_retry(device, start, num, data, nbytes))
+    for (i = 0; i < SWPA_TABLE_N_SECTOR; i += unit)
     {
-        SWAP_ERR("nbytes %u\n", nbytes);
-        kfree(data);
-        return NULL;
+        if (0 != hd_read_sector_retry(device, start + i, unit, buf + i * SECTOR_SIZE, unit * SECTOR_SIZE)) 
+        {
+            memset(buf + i * SECTOR_SIZE, 0, unit * SECTOR_SIZE);
+            bitmap_set(bad, i, unit);
+            ret = -1;
+        }
     }
 
-    // for test only
-    /* {
-        char buf[32]; 
-        memcpy(buf, data, 31);
-        buf[31] = 0;
-        printk("-->read data:%s\n", buf);
-    } */
-
-    return data;
+    return ret;
 }
 
 /*****************************************************************************
  函 数 名  : calc_swap_info_num
- 功能描述  : 读取并计算映射个数
+ 功能描述  : 计算已读出的映射表中的映射个数, 跳过读失败的扇区
  输入参数  : 
  输出参数  : 
  返 回 值  : 返回总的映射个数
@@ -1311,42 +1740,33 @@ static char *alloc_swap_info_data(struct scsi_device *device, sector_t start, u3
     修改内容   : 新生成函数
 
 *****************************************************************************/
-static int calc_swap_info_num(struct scsi_device *device, sector_t start, u32 num)
+static int calc_swap_info_num(struct scsi_swap_core *core, const char *buf, const unsigned long *bad)
 {
-    char buffer[SECTOR_SIZE] = {0};
-    struct swap_table *table = NULL;
+    struct swap_table table;
     int swap_table_len = 0;
     int i = 0;
     int j = 0;
     int table_num_per_sect = 0;
     int total_table_num = 0;
 
-    swap_table_len = sizeof (struct swap_table);
+    swap_table_len = swap_table_entry_len(core);
 
     /* 每个扇区可以放的swap_table个数 */
     table_num_per_sect = SECTOR_SIZE / swap_table_len;    
 
 
-    /* 读取每个扇区, 解析出每个swap_table, 直到读取到无效的值 */
-    for (i = 0; i < num; ++i)
+    /* 解析每个扇区的swap_table, 直到读取到无效的值 */
+    for (i = 0; i < SWPA_TABLE_N_SECTOR; ++i)
     {
-        memset(buffer, 0, SECTOR_SIZE);
-        if (0 != hd_read_sector_retry(device, start++, 1, buffer, SECTOR_SIZE)) 
+        if (test_bit(i, bad))
         {
             continue;
         }
 
         for (j = 0; j < table_num_per_sect; ++j)
         {
-            table = (struct swap_table *)(buffer + swap_table_len * j);
-
-            /* 不等于定义的值即无效 */
-            if (table->sec_size != SECTOR_NUM_PER_SWAP_BLOCK)
-            {
-                return total_table_num;
-            }
-
-            if (swap_crc32(~0, table, swap_table_len - sizeof(u32) - sizeof(sector_t)) != table->checksum)
+            /* 表结束或者校验失败都即无效 */
+            if (0 != swap_table_decode(core, buf + i * SECTOR_SIZE + swap_table_len * j, &table))
             {
                 return total_table_num;
             }
@@ -1377,35 +1797,40 @@ static int calc_swap_info_num(struct scsi_device *device, sector_t start, u32 nu
 static int init_swap_info(struct scsi_swap_core *core, u32 num)
 {
     struct swap_info *info = NULL;
-    sector_t start = 0;
     sector_t start_master = 0;
     sector_t start_back = 0;
-    char buffer[SECTOR_SIZE] = {0};
+    char *buffer = NULL;
+    DECLARE_BITMAP(bad, SWPA_TABLE_N_SECTOR);
+    DECLARE_BITMAP(bad_back, SWPA_TABLE_N_SECTOR);
     int table_num_per_sect = 0;
-    u32 crc_val = 0;
     int swap_table_len = 0;
     int table_num = 0;
     int table_num_back = 0;
     swap_table_sync_e sync = NO_NEED_SYNC;
     int i, j;
+    int ret;
     int end_flag = 0;
-	struct scsi_device *device = core_to_scsi_device(core);
     
     start_master = core->sector_table;
     start_back = core->sector_reserve_start + SWAP_TABLE_BACKUP_OFFSET;
 
-    swap_table_len = sizeof (struct swap_table);
+    swap_table_len = swap_table_entry_len(core);
 
     /* 每个扇区可以放的swap_table个数 */
     table_num_per_sect = SECTOR_SIZE / swap_table_len;    
 
     INIT_LIST_HEAD(&core->info_list);
+    INIT_RADIX_TREE(&core->info_tree, GFP_NOIO);
 
     atomic_set(&core->info_num, 0);
 
+    /* 主表读到table_disk, 备表读到table_buf, 各一条命令 */
+    swap_table_read(core, start_master, core->table_disk, bad);
+    swap_table_read(core, start_back, core->table_buf, bad_back);
+
     /* 先分别计算主和备的table数量 */
-    table_num = calc_swap_info_num(device, start_master, SWPA_TABLE_N_SECTOR);
-    table_num_back = calc_swap_info_num(device, start_back, SWPA_TABLE_N_SECTOR);
+    table_num = calc_swap_info_num(core, core->table_disk, bad);
+    table_num_back = calc_swap_info_num(core, core->table_buf, bad_back);
 
     SWAP_ERR("table num: %d %d\n", table_num, table_num_back);
     
@@ -1413,13 +1838,13 @@ static int init_swap_info(struct scsi_swap_core *core, u32 num)
     if (table_num_back > table_num)
     {
         SWAP_ERR("use backup table,table num: %d %d\n", table_num, table_num_back);
-        start = start_back;
+        memcpy(core->table_disk, core->table_buf, SWPA_TABLE_N_SECTOR * SECTOR_SIZE);
+        bitmap_copy(bad, bad_back, SWPA_TABLE_N_SECTOR);
         sync = MASTER_NEED_SYNC;
     }
     else if (table_num_back < table_num)
     {
         SWAP_ERR("use master table,table num: %d %d\n", table_num, table_num_back);
-        start = start_master;
         sync = BACKUP_NEED_SYNC;
     }
     else
@@ -1428,20 +1853,19 @@ static int init_swap_info(struct scsi_swap_core *core, u32 num)
         {
             return 0;
         }
-        start = start_master;
         sync = NO_NEED_SYNC;
     }
 
-    /* 读取每个扇区, 解析出每个swap_table, 直到读取到无效的值 */
+    /* 解析每个扇区, 解析出每个swap_table, 直到读取到无效的值 */
     for (i = 0; i < SWPA_TABLE_N_SECTOR; ++i)
     {
-        memset(buffer, 0, SECTOR_SIZE);
-        if (0 != hd_read_sector_retry(device, start++, 1, buffer, SECTOR_SIZE)) 
+        if (test_bit(i, bad))
         {
             SWAP_ERR("read swap table fail\n");
-            //return -1;
             continue;
         }
+
+        buffer = core->table_disk + i * SECTOR_SIZE;
         
         /* 创建table表 */
         for (j = 0; j < table_num_per_sect; ++j)
@@ -1455,83 +1879,46 @@ static int init_swap_info(struct scsi_swap_core *core, u32 num)
 
             memset(info, 0, sizeof (struct swap_info));
             
-            memcpy(&info->table, buffer + swap_table_len * j, swap_table_len);
+            ret = swap_table_decode(core, buffer + swap_table_len * j, &info->table);
 
             /* 不等于定义的值即无效 */
-            if (info->table.sec_size != SECTOR_NUM_PER_SWAP_BLOCK)
+            if (1 == ret)
             {
-                SWAP_ERR("all done, sector %d, index %d, size: %d\n", i, j, info->table.sec_size);
+                SWAP_ERR("all done, sector %d, index %d\n", i, j);
                 kfree(info);
                 end_flag = 1;
                 break;
             }
-            
-            /* 如果交换扇区小于不在保留扇区范围，或者损坏的源扇区属于保留扇区 */
-            if ((info->table.swap_sec < core->sector_data) || (info->table.src_sec > core->sector_reserve_start))
+
+            if (0 != ret)
             {
-                SWAP_ERR("source sector or dest sector error\n");
+                SWAP_ERR("crc check fail\n");
                 kfree(info);
                 return -1;
             }
             
-            crc_val = swap_crc32(~0, &info->table, swap_table_len - sizeof(u32) - sizeof(sector_t));
-
-            if (crc_val != info->table.checksum)
+            /* 如果交换扇区小于不在保留扇区范围，或者损坏的源扇区属于保留扇区 */
+            if ((info->table.swap_sec < core->sector_data) || (info->table.src_sec > core->sector_reserve_start))
             {
-                SWAP_ERR("crc check fail\n");
+                SWAP_ERR("source sector or dest sector error\n");
                 kfree(info);
                 return -1;
             }
             
-            info->data = alloc_swap_info_data(device, info->table.swap_sec, info->table.sec_size);
-
-            if (NULL == info->data)
-            {
-                SWAP_ERR("realloc swap sector\n");
-                if (0 == swap_recreate(core, info))
-                {
-                    memcpy(buffer + swap_table_len * j, &info->table, swap_table_len);
-                }
-                else
-                {
-                    SWAP_ERR("swap_recreate fail\n");
-                    kfree(info);
-                    return -1;
-                }
-            }
+            /* 只加载映射表, 数据按需读入缓存, 见scsi_swap_core_load */
+            info->data = NULL;
+            INIT_LIST_HEAD(&info->lru);
             
             // 初始化阶段
-            spin_lock(&core->info_list_lock);
-            list_add_tail(&info->list, &core->info_list);
-            spin_unlock(&core->info_list_lock);
-            /* 更新总的交换扇区数 */
-            atomic_inc(&core->info_num);
-        }
-
-        /* 主备进行同步 */
-        if (MASTER_NEED_SYNC == sync)
-        {
-            while (0 != hd_write_sector_retry(device, start_master++, 1, buffer, SECTOR_SIZE)) 
+            if (0 != swap_info_link(core, info))
             {
-                SWAP_ERR("sync to swap master table failed\n");
-                if (start_master >= (core->sector_table + SWPA_TABLE_N_SECTOR))
-                {
-                    break;
-                }
-            }
-        }
-        else if (BACKUP_NEED_SYNC == sync)
-        {
-            while (0 != hd_write_sector_retry(device, start_back++, 1, buffer, SECTOR_SIZE)) 
-            {
-                SWAP_ERR("sync to swap backup table failed\n");
-                if (start_back >= (core->sector_reserve_start + SWAP_TABLE_BACKUP_OFFSET + SWPA_TABLE_N_SECTOR))
-                {
-                    break;
-                }
+                SWAP_ERR("duplicate or unindexable swap %llu\n", 
+                        (unsigned long long)info->table.src_sec);
+                _swap_dealloc_info(info);
+                return -1;
             }
         }
-        
+
         if (1 == end_flag)
         {
             break;
@@ -1539,6 +1926,12 @@ static int init_swap_info(struct scsi_swap_core *core, u32 num)
         
     }
 
+    /* 主备不一致时, 当作盘上没有表, 提交时主备全部重写 */
+    if (NO_NEED_SYNC != sync)
+    {
+        memset(core->table_disk, 0, SWPA_TABLE_N_SECTOR * SECTOR_SIZE);
+    }
+
     SWAP_ERR("total info num: %d\n", atomic_read(&core->info_num));
     
     return 0;
@@ -1549,29 +1942,61 @@ static int swap_info_destroy(struct scsi_swap_core *core)
     struct swap_info *entry;
     struct swap_info *next;
 
-    spin_lock(&core->info_list_lock);
+    mutex_lock(&core->info_list_mutex);
 
     list_for_each_entry_safe(entry, next, &core->info_list, list) 
     {
         if (NULL != entry)
         {
-            list_del(&entry->list);
-            if (NULL != entry->data)
-            {
-                kfree(entry->data);
-                entry->data = NULL;
-            }
-            kfree(entry);
-            entry = NULL;
+            radix_tree_delete(&core->info_tree, SWAP_BLOCK_INDEX(core, entry->table.src_sec));
+            list_del_rcu(&entry->list);
+            _swap_dealloc_info_rcu(entry);
         }
     }
 
-    list_del_init(&core->info_list);
-    spin_unlock(&core->info_list_lock);
+    if (0 != atomic_xchg(&core->info_num, 0))
+    {
+        static_key_slow_dec(&scsi_swap_remap_key);
+    }
+    INIT_LIST_HEAD(&core->cache_lru);
+    core->cache_num = 0;
+    mutex_unlock(&core->info_list_mutex);
+
+    /* 等待所有释放回调完成 */
+    rcu_barrier();
 
     return 0;
 }
 
+/*
+ * 元数据和映射块读写的最小单位: 物理块, 最大SWAP_HEAD_N_SECTOR.
+ * 512e盘上保留区没有对齐到物理块时只能按逻辑块.
+ * 返回: 扇区数, 0 表示不支持的逻辑块大小
+ */
+static u32 swap_io_sectors(struct scsi_swap_core *core)
+{
+    struct scsi_device *sdev = core_to_scsi_device(core);
+    struct request_queue *q = sdev->request_queue;
+    u32 logical = max(sdev->sector_size, (unsigned)SECTOR_SIZE) / SECTOR_SIZE;
+    u32 phys = queue_physical_block_size(q) / SECTOR_SIZE;
+    u32 offset = queue_alignment_offset(q) / SECTOR_SIZE;
+
+    /* 头区只有SWAP_HEAD_N_SECTOR个扇区, 映射块最小也是这么大 */
+    if (logical > SWAP_HEAD_N_SECTOR)
+    {
+        return 0;
+    }
+
+    phys = clamp_t(u32, phys, logical, SWAP_HEAD_N_SECTOR);
+    if (!is_power_of_2(phys) || 0 != ((core->sector_reserve_start - offset) & (phys - 1)))
+    {
+        SWAP_ERR("reserved area not aligned to %u sectors\n", phys);
+        return logical;
+    }
+
+    return phys;
+}
+
 int scsi_swap_core_init(struct scsi_swap_core *core, sector_t reserve_sector)
 {
 	struct gendisk *disk;
@@ -1591,25 +2016,112 @@ int scsi_swap_core_init(struct scsi_swap_core *core, sector_t reserve_sector)
 			(unsigned long long)core->sector_data, 
 			(unsigned long long)core->sector_table);
 
-    spin_lock_init(&core->info_list_lock);
+    /* 头, 映射表, 日志和映射块都按物理块读写 */
+    core->phys_sectors = swap_io_sectors(core);
+    if (0 == core->phys_sectors)
+    {
+        SWAP_ERR("[%s]unsupported sector size %u\n", disk->disk_name, 
+                core_to_scsi_device(core)->sector_size);
+        return -1;
+    }
+
+    mutex_init(&core->info_list_mutex);
+    mutex_init(&core->bitmap_mutex);
+    mutex_init(&core->commit_mutex);
+    INIT_LIST_HEAD(&core->cache_lru);
+    core->cache_max = max(swap_cache_blocks, 1U);
+    atomic64_set(&core->cache_hit, 0);
+    atomic64_set(&core->cache_miss, 0);
+
+    /* 这时还不知道块大小, 按最大的分配 */
+    core->zero_block = kzalloc(SWAP_BLOCK_MAX_SIZE, GFP_KERNEL);
+    if (NULL == core->zero_block)
+    {
+        SWAP_ERR("[%s]alloc zero block failed\n", disk->disk_name);
+		return -1;
+    }
+
+    /* 
+     * 盘上映射表的内容和提交时生成的映射表, 各SWPA_TABLE_N_SECTOR个扇区,
+     * 后面是读写头用的一个物理块
+     */
+    core->table_disk = kzalloc(2 * SWPA_TABLE_N_SECTOR * SECTOR_SIZE + SWAP_HEAD_N_SECTOR * SECTOR_SIZE, GFP_KERNEL);
+    if (NULL == core->table_disk)
+    {
+        SWAP_ERR("[%s]alloc table buffer failed\n", disk->disk_name);
+		kfree(core->zero_block);
+		return -1;
+    }
+    core->table_buf = core->table_disk + SWPA_TABLE_N_SECTOR * SECTOR_SIZE;
+    core->head_buf = core->table_buf + SWPA_TABLE_N_SECTOR * SECTOR_SIZE;
 
     if (0 != init_swap_head(core, core->sector_head, SWAP_HEAD_N_SECTOR))
     {
         SWAP_ERR("[%s]init head failed\n", disk->disk_name);
-		return -1;
+		goto err;
+    }
+    memcpy(core->head_disk_bitmap, core->head.bitmap, sizeof(core->head.bitmap));
+
+    /* 旧的头没有记录块大小, 都是128扇区 */
+    core->block_sectors = core->head.block_sectors ? core->head.block_sectors : SECTOR_NUM_PER_SWAP_BLOCK;
+    if (!swap_block_sectors_valid(core->block_sectors))
+    {
+        SWAP_ERR("[%s]invalid block size %u\n", disk->disk_name, core->block_sectors);
+		goto err;
+    }
+    core->block_shift = ilog2(core->block_sectors);
+
+    core->cache_spare = kmalloc(SWAP_BLOCK_SIZE(core), GFP_KERNEL);
+    if (NULL == core->cache_spare)
+    {
+        SWAP_ERR("[%s]alloc spare cache block failed\n", disk->disk_name);
+		goto err;
+    }
+
+    /* 按头里的版本号解析映射表 */
+    if (0 == strncmp(core->head.version, SWAP_VERSION, SWAP_HEAD_VERSION_LEN))
+    {
+        core->table_version = 2;
+    }
+    else if (0 == strncmp(core->head.version, SWAP_VERSION_0001, SWAP_HEAD_VERSION_LEN))
+    {
+        core->table_version = 1;
+    }
+    else
+    {
+        SWAP_ERR("[%s]unknown table version %.4s\n", disk->disk_name, core->head.version);
+		goto err;
     }
 
     if (0 != init_swap_info(core, SWPA_TABLE_N_SECTOR)) 
     {
         SWAP_ERR("[%s]init info failed\n", disk->disk_name);
 		swap_info_destroy(core);
-		return -1;
+		goto err;
+    }
+
+    /* 0001格式的盘在线升级, 失败时继续用0001格式, 最多MAX_SWAP_BLOCK_FOR_USE个映射 */
+    if (1 == core->table_version && 0 != swap_table_upgrade(core))
+    {
+        SWAP_ERR("[%s]upgrade table to %s failed\n", disk->disk_name, SWAP_VERSION);
+    }
+
+    /* 主备映射表不一致时, 在这里重写 */
+    if (0 != swap_table_commit(core))
+    {
+        SWAP_ERR("[%s]commit table failed\n", disk->disk_name);
     }
 
     atomic_set(&core->device_dead, 0);
     atomic_set(&core->user, 0);
 
     return 0;
+
+err:
+    kfree(core->cache_spare);
+    kfree(core->table_disk);
+    kfree(core->zero_block);
+    return -1;
 }
 
 int scsi_swap_core_destroy(struct scsi_swap_core *core)
@@ -1636,12 +2148,21 @@ int scsi_swap_core_destroy(struct scsi_swap_core *core)
     SWAP_ERR("%s\n", (i>=100)?"waiting r/w timeout":"r/w completed\n");
 
 	swap_info_destroy(core);
+	kfree(core->cache_spare);
+	kfree(core->table_disk);
+	kfree(core->zero_block);
 
     return 0;
 }
 
 int scsi_swap_core_swapped(struct scsi_swap_core *core, sector_t sector, u32 num)
 {
+    /* 没有映射的硬盘, 不查表 */
+    if (0 == atomic_read(&core->info_num))
+    {
+        return 0;
+    }
+
     return _did_block_swapped(core, sector, num);
 }
 
@@ -1718,9 +2239,85 @@ int scsi_swap_core_can_swap(struct scsi_swap_core *core, sector_t sector, u32 nu
 //    return -1;
 //}
 
+/* 第i个block在[start, start+count)内的扇区范围 */
+static inline void swap_block_range(struct scsi_swap_core *core, sector_t start, u32 count, int i, 
+        sector_t *b_start, sector_t *s_start, int *s_count)
+{
+    sector_t end = start + count;
+
+    *b_start = SWAP_BLOCK_SECTOR(core, SWAP_BLOCK_INDEX(core, start) + i);
+    *s_start = max(start, *b_start);
+    *s_count = (int)(min(end, *b_start + core->block_sectors) - *s_start);
+}
+
+/*
+ * 读失败或坏块, 修复或创建映射后, 从映射块读
+ * 返回: 0 成功, -1 失败
+ */
+static int swap_read_create(struct scsi_swap_core *core, struct swap_sg *sg, 
+        sector_t b_start, sector_t s_start, int s_count)
+{
+    int s_len = s_count * SECTOR_SIZE;
+    swap_info_t *info;
+    int ret = 0;
+    struct scsi_device *device = core_to_scsi_device(core);
+
+    /* 逐个扇区进行修复 */
+    ret = swap_repair_successive_sectors(device, s_start, s_count);
+    if (0 == ret)
+    {
+        /* 修复成功，更新数据，全0 */
+        swap_sg_zero(sg, s_len);
+        SWAP_ERR("sector %llu, %d repair success\n", 
+                (unsigned long long)s_start, s_count);
+        return 0;
+    }
+
+    SWAP_ERR("sector %llu, %d repair fail\n", 
+            (unsigned long long)s_start, s_count);
+    if (0 != atomic_read(&core->device_dead))
+    {
+        /* 设备已经不可用，返回 */
+        return -1;
+    }
+
+    // 坏块,  或者读失败, 需要创建一个交换块
+    info = swap_create(core, s_start, s_count);
+    if(NULL == info)
+    {
+        SWAP_ERR("create swap %llu, %d failed\n", 
+                (unsigned long long)s_start, s_count);
+        return -1;
+    }
+
+    swap_sg_from_buf(sg, info->data + (u32)(s_start - b_start)* SECTOR_SIZE, s_len);
+
+    // 更新目标数据
+    if (0 != flush_swap_info_data(core, info))
+    {
+        swap_bitmap_set_bit((unsigned long *)core->head.bitmap, (int)info->table.index, 0);
+        _swap_dealloc_info(info);
+        return -1;
+    }
+
+    // 加入到链表, 映射表由调用者在本批结束后一起落盘
+    if (0 != swap_info_link(core, info))
+    {
+        swap_bitmap_set_bit((unsigned long *)core->head.bitmap, (int)info->table.index, 0);
+        _swap_dealloc_info(info);
+        return -1;
+    }
+
+    /* 新建的块数据就在内存里, 直接加入缓存 */
+    swap_cache_add(core, info);
+
+    return 0;
+}
+
 /*****************************************************************************
  函 数 名  : core_read
- 功能描述  : 映射块读函数
+ 功能描述  : 映射块读函数, 映射块从内存读, 其他块并发提交到硬盘, 
+             全部完成后再逐个处理失败的块
  输入参数  : 
  输出参数  : 
  返 回 值  : 0 成功, -1 失败, -DATA_MAY_DIRTY 表示成功，但数据可能不完整
@@ -1733,20 +2330,25 @@ int scsi_swap_core_can_swap(struct scsi_swap_core *core, sector_t sector, u32 nu
     修改内容   : 新生成函数
 
 *****************************************************************************/
-int scsi_swap_core_read(struct scsi_swap_core *core, sector_t start, u32 count, sector_t bad, void *buf, u32 buf_size)
+int scsi_swap_core_read(struct scsi_swap_core *core, sector_t start, u32 count, sector_t bad, struct swap_sg *sg)
 {
-    int i;
-    int b_count = get_swap_block_count(start, count);
-    int i_start = SWAP_BLOCK_INDEX(start);
-    int i_bad = ((bad == -1) ? -1 : SWAP_BLOCK_INDEX(bad));
-    u32 b_start;
+    int i, j, n;
+    int b_count = get_swap_block_count(core, start, count);
+    int i_start = SWAP_BLOCK_INDEX(core, start);
+    int i_bad = ((bad == -1) ? -1 : SWAP_BLOCK_INDEX(core, bad));
+    sector_t b_start;
     sector_t s_start;
     int s_count;
-    int s_len;
     swap_info_t *info;
+    swap_info_t *fills[SWAP_AIO_BATCH];
+    struct swap_aio aio;
+    struct swap_aio_req reqs[SWAP_AIO_BATCH];
+    struct swap_sg pos[SWAP_AIO_BATCH];
     int data_dirty = 0;
+    int need_commit = 0;
     int ret = 0;
     struct scsi_device *device = core_to_scsi_device(core);
+    struct scsi_swap_stats *stats = core_to_swap_stats(core);
 
     if (0 != atomic_read(&core->device_dead))
     {
@@ -1761,117 +2363,130 @@ int scsi_swap_core_read(struct scsi_swap_core *core, sector_t start, u32 count,
 
     atomic_inc(&core->user);
 
-    for(i=0; i<b_count; ++i)
+    for(i=0; i<b_count; i+=n)
     {
-        b_start = SWAP_BLOCK_SECTOR(i_start+i);
-        s_start = i == 0 ? start : b_start;
-        s_count = min(count, (u32)(SWAP_BLOCK_SECTOR(i_start+i+1)-s_start));
-        s_len = s_count * SECTOR_SIZE;
-        //SWAP_DEBUG("b_start %u, s_start %llu, s_count %d\n", b_start, s_start, s_count);
-                
-        info = swap_find_swap_info(core, b_start);
-        if(NULL != info)
-        {
-            // 找到, 直接从内存读.
-            _swap_read(core, info, s_start, s_count, buf, s_len);
-            //SWAP_ERR("read from swap memory, sector %llu, count %u\n", s_start, s_count);
-        }
-        else
+        n = min(b_count - i, SWAP_AIO_BATCH);
+        swap_aio_init(&aio);
+
+        /* 缓存的映射块直接从内存读, 其他映射块读入缓存, 不是坏块的一起提交到硬盘 */
+        for (j=0; j<n; ++j)
         {
-            if(i_bad != i_start+i)
+            swap_block_range(core, start, count, i+j, &b_start, &s_start, &s_count);
+            pos[j] = *sg;
+            reqs[j].result = -1;
+            fills[j] = NULL;
+
+            info = swap_find_swap_info(core, b_start);
+            if(NULL != info && NULL != info->data)
             {
-                // 不是坏块, 直接读磁盘
-                if(0 == hd_read_sector_retry(device, s_start, s_count, (void*)buf, s_len))
-                {
-                    count -= s_count;
-                    buf += s_len;
-                    buf_size -= s_len;
-                    continue;
-                }
-                else if (0 != atomic_read(&core->device_dead))
+                // 缓存命中, 直接从内存读.
+                swap_cache_touch(core, info);
+                _swap_read(core, info, s_start, s_count, sg);
+                swap_stat_add(stats, SWAP_STAT_RAM_BYTES, s_count * SECTOR_SIZE);
+                reqs[j].result = 0;
+            }
+            else if(NULL != info)
+            {
+                // 没有缓存, 整块读入缓存; 没有缓存可用时直接从映射块读
+                atomic64_inc(&core->cache_miss);
+                swap_stat_add(stats, SWAP_STAT_POOL_BYTES, s_count * SECTOR_SIZE);
+                info->data = swap_cache_get_buf(core);
+                if (NULL != info->data)
                 {
-                    /* 设备已经不可用，返回 */
-                    goto err;
+                    fills[j] = info;
+                    hd_submit_sector(device, READ, info->table.swap_sec, info->table.sec_size, 
+                            info->data, info->table.sec_size * SECTOR_SIZE, &reqs[j], &aio);
                 }
                 else
                 {
-                    /* 如果读失败，说明还有坏块，继续进行下面的坏块映射 */
-                    SWAP_ERR("hd_read_sector_retry failed\n");
+                    hd_submit_sg(device, READ, info->table.swap_sec + (s_start - b_start), 
+                            s_count, sg, &reqs[j], &aio);
                 }
             }
+            else if(i_bad != i_start+i+j)
+            {
+                // 不是坏块, 直接读磁盘
+                hd_submit_sg(device, READ, s_start, s_count, sg, &reqs[j], &aio);
+            }
+
+            swap_sg_skip(sg, s_count * SECTOR_SIZE);
+        }
+
+        swap_aio_wait(&aio);
+
+        /* 读入缓存的块复制到bio, 读失败的块和坏块, 逐个创建映射 */
+        for (j=0; j<n; ++j)
+        {
+            swap_block_range(core, start, count, i+j, &b_start, &s_start, &s_count);
 
-            /* 逐个扇区进行修复 */
-            ret = swap_repair_successive_sectors(device, s_start, s_count);
-            if (0 == ret)
+            /* 内存不够等没有发出去的, 整个bio失败, 不建映射 */
+            if (hd_result_unsent(reqs[j].result))
             {
-                /* 修复成功，更新数据，全0 */
-                memset(buf, 0, (size_t)s_len);
-                count -= s_count;
-                buf += s_len;
-                buf_size -= s_len;
-                SWAP_ERR("sector %llu, %d repair success\n", 
-						(unsigned long long)s_start, s_count);
-                continue;
+                SWAP_ERR("swap read not submitted %d\n", reqs[j].result);
+                ret = -1;
+                break;
             }
-            else
+
+            if (NULL != fills[j])
             {
-                SWAP_ERR("sector %llu, %d repair fail\n", 
-						(unsigned long long)s_start, s_count);
-                if (0 != atomic_read(&core->device_dead))
+                /* 映射块读失败, 重建映射 */
+                if (0 != reqs[j].result)
                 {
-                    /* 设备已经不可用，返回 */
-                    goto err;
+                    need_commit = 1;
+                    if (0 != swap_recreate(core, fills[j]))
+                    {
+                        ret = -1;
+                        break;
+                    }
                 }
+                swap_cache_add(core, fills[j]);
+                _swap_read(core, fills[j], s_start, s_count, &pos[j]);
+                continue;
             }
-            
-            
-            // 坏块,  或者读失败, 需要创建一个交换块
-            info = swap_create(core, s_start, s_count);
-            if(NULL == info)
+
+            if (0 == reqs[j].result)
             {
-                SWAP_ERR("create swap %llu, %d failed\n", 
-						(unsigned long long)s_start, s_count);
-                goto err;
+                continue;
             }
 
-            memcpy(buf, (void *)(info->data + (u32)(s_start - b_start)* SECTOR_SIZE), 
-					(size_t)min((u32)s_len, (u32)SWAP_BLOCK_SIZE));
-
-            // 更新目标数据
-            if (0 != flush_swap_info_data(core, info))
+            /* 设备已经不可用, 或者没有缓存时直接读映射块失败 */
+            if (0 != atomic_read(&core->device_dead) || 
+                    NULL != swap_find_swap_info(core, b_start))
             {
-                swap_bitmap_set_bit((unsigned long *)core->head.bitmap, (int)info->table.index, 0);
-                _swap_dealloc_info(info);
-                goto err;
+                ret = -1;
+                break;
             }
 
-            // 加入到链表
-            spin_lock(&core->info_list_lock);
-            list_add_tail(&info->list, &core->info_list);
-            spin_unlock(&core->info_list_lock);
-
-            // 更新table
-            if (0 != flush_swap_info_table(core))
+            need_commit = 1;
+            if (0 != swap_read_create(core, &pos[j], b_start, s_start, s_count))
             {
-                swap_bitmap_set_bit((unsigned long *)core->head.bitmap, (int)info->table.index, 0);
-                _swap_dealloc_info(info);
-                goto err;
+                ret = -1;
+                break;
             }
 
-            /* 更新总的交换扇区数 */
-            atomic_inc(&core->info_num);
-
             /* 因为读错误创建新映射时，需要更新 */
             data_dirty = 1;
-            
         }
 
+        if (0 != ret)
+        {
+            /* 还没加入缓存的块, 释放读入用的缓存 */
+            for (j=0; j<n; ++j)
+            {
+                if (NULL != fills[j] && list_empty(&fills[j]->lru))
+                {
+                    swap_cache_put_buf(core, fills[j]->data);
+                    fills[j]->data = NULL;
+                }
+            }
+            goto err;
+        }
 
-        //buf_show("after read a swap", buf, buf_size);
-
-        count -= s_count;
-        buf += s_len;
-        buf_size -= s_len;
+        /* 本批新建的映射一起落盘 */
+        if (1 == need_commit && 0 != swap_table_commit(core))
+        {
+            goto err;
+        }
     }
 
     atomic_dec(&core->user);
@@ -1888,9 +2503,79 @@ err:
     return -1;
 }
 
+/*
+ * 写失败或坏块, 修复或创建映射后, 写入映射块
+ * 返回: 0 成功, -1 失败, -DATA_MAY_DIRTY 表示成功，但数据可能不完整
+ */
+static int swap_write_create(struct scsi_swap_core *core, struct swap_sg *sg, 
+        sector_t s_start, int s_count)
+{
+    swap_info_t *info;
+    int ret = 0;
+    struct scsi_device *device = core_to_scsi_device(core);
+
+    /* 逐个扇区进行修复 */
+    ret = swap_repair_successive_sectors(device, s_start, s_count);
+    if (0 == ret)
+    {
+        /* 修复成功，更新数据 */
+        ret = hd_write_sg_retry(device, s_start, s_count, sg);
+        if (0 == ret)
+        {
+            return 0;
+        }
+        if (hd_result_unsent(ret))
+        {
+            return -1;
+        }
+    }
+    else if (0 != atomic_read(&core->device_dead))
+    {
+        /* 设备已经不可用，返回 */
+        return -1;
+    }
+
+    // 坏块, 或者写失败, 需要创建一个交换块
+    info = swap_create(core, s_start, s_count);
+    if(NULL == info)
+    {
+        SWAP_ERR("create swap %llu, %u failed\n", 
+                (unsigned long long)s_start, s_count);
+        return -1;
+    }
+    
+    // 更新内存, 然后更新到磁盘
+    if (0 != swap_write(core, info, s_start, s_count, sg))
+    {
+        swap_bitmap_set_bit((unsigned long *)core->head.bitmap, (int)info->table.index, 0);
+        _swap_dealloc_info(info);
+        return -1;
+    }
+
+    // 加入到链表, 映射表由调用者在本批结束后一起落盘
+    if (0 != swap_info_link(core, info))
+    {
+        swap_bitmap_set_bit((unsigned long *)core->head.bitmap, (int)info->table.index, 0);
+        _swap_dealloc_info(info);
+        return -1;
+    }
+
+    /* 新建的块数据就在内存里, 直接加入缓存 */
+    swap_cache_add(core, info);
+
+    /* 当待写的扇区少于一个block时，需要更新 */
+    if (s_count < core->block_sectors)
+    {
+        return -DATA_MAY_DIRTY;
+    }
+
+    return 0;
+}
+
 /*****************************************************************************
  函 数 名  : core_write
- 功能描述  : 映射块写函数
+ 功能描述  : 映射块写函数, 映射块和其他块的写并发提交到硬盘, 
+             全部完成后再逐个处理失败的块
  输入参数  : 
  输出参数  : 
  返 回 值  : 0 成功, -1 失败, -DATA_MAY_DIRTY 表示成功，但数据可能不完整
@@ -1903,20 +2588,27 @@ err:
     修改内容   : 新生成函数
 
 *****************************************************************************/
-int scsi_swap_core_write(struct scsi_swap_core *core, sector_t start, u32 count, sector_t bad, const void *buf, u32 buf_size)
+int scsi_swap_core_write(struct scsi_swap_core *core, sector_t start, u32 count, sector_t bad, struct swap_sg *sg)
 {
-    int i;
-    int b_count = get_swap_block_count(start, count);
-    int i_start = SWAP_BLOCK_INDEX(start);
-    int i_bad = bad == -1 ? -1 : SWAP_BLOCK_INDEX(bad);
-    u32 b_start;
+    int i, j, n;
+    int b_count = get_swap_block_count(core, start, count);
+    int i_start = SWAP_BLOCK_INDEX(core, start);
+    int i_bad = bad == -1 ? -1 : SWAP_BLOCK_INDEX(core, bad);
+    sector_t b_start;
     sector_t s_start;
     int s_count;
-    int s_len;
+    int d_start;
+    int d_count;
     swap_info_t *info;
+    swap_info_t *infos[SWAP_AIO_BATCH];
+    struct swap_aio aio;
+    struct swap_aio_req reqs[SWAP_AIO_BATCH];
+    struct swap_sg pos[SWAP_AIO_BATCH];
     int data_dirty = 0;
+    int need_commit = 0;
     int ret = 0;
     struct scsi_device *device = core_to_scsi_device(core);
+    struct scsi_swap_stats *stats = core_to_swap_stats(core);
     
     if (0 != atomic_read(&core->device_dead))
     {
@@ -1927,131 +2619,109 @@ int scsi_swap_core_write(struct scsi_swap_core *core, sector_t start, u32 count,
 
     atomic_inc(&core->user);
 
-    for(i=0; i<b_count; ++i)
+    for(i=0; i<b_count; i+=n)
     {
-        b_start = SWAP_BLOCK_SECTOR(i_start+i);
-        s_start = ((i == 0) ? start : b_start);
-        s_count = min(count, (u32)(SWAP_BLOCK_SECTOR(i_start+i+1)-s_start));
-        s_len = s_count * SECTOR_SIZE;
-        
-        info = swap_find_swap_info(core, b_start);
-        if(NULL != info)
+        n = min(b_count - i, SWAP_AIO_BATCH);
+        swap_aio_init(&aio);
+
+        /* 映射块更新缓存后写映射区, 不是坏块的直接写磁盘, 一起提交 */
+        for (j=0; j<n; ++j)
         {
-            // 找到, 直接写内存, 然后更新到磁盘
-            ret = swap_write(core, info, s_start, s_count, buf, s_len);
-            if (0 != ret)
+            swap_block_range(core, start, count, i+j, &b_start, &s_start, &s_count);
+            pos[j] = *sg;
+            reqs[j].result = -1;
+
+            infos[j] = info = swap_find_swap_info(core, b_start);
+            if (NULL != info)
             {
-                if (-DATA_MAY_DIRTY == ret)  /* 重映射成功，但数据可能需要更新 */
-                {
-                    /* 当待写的扇区少于一个block时，需要更新 */
-                    if (s_count < SECTOR_NUM_PER_SWAP_BLOCK)
-                    {
-                        data_dirty = 1;
-                    }
-                }
-                else
-                {
-                    SWAP_ERR("swap_write fail\n");
-                    goto err;
-                }
+                swap_stat_add(stats, SWAP_STAT_POOL_BYTES, s_count * SECTOR_SIZE);
             }
-            //SWAP_ERR("write to swap memory, sector %llu, count %u\n", s_start, s_count);
-            
-        }
-        else
-        {
-            /* 不是坏块, 直接写磁盘 */
-            if(i_bad != i_start+i)
+
+            if(NULL != info && NULL != info->data)
             {
-                /* 写成功，返回继续处理后面的扇区  */
-                if(0 == hd_write_sector_retry(device, s_start, s_count, (void*)buf, s_len))
-                {
-                    count -= s_count;
-                    buf += s_len;
-                    buf_size -= s_len;
-                    continue;
-                }
-                else if (0 != atomic_read(&core->device_dead))
-                {
-                    /* 设备已经不可用，返回 */
-                    goto err;
-                }
-                else
-                {
-                    /* 如果写失败，说明还有坏块，继续进行下面的坏块映射 */
-                    SWAP_ERR("hd_write_sector failed\n");
-                }
+                // 缓存命中, 直接写内存, 然后只把改过的物理块更新到磁盘
+                swap_cache_touch(core, info);
+                swap_sg_to_buf(sg, info->data + (u32)(s_start - b_start) * SECTOR_SIZE, 
+                        s_count * SECTOR_SIZE);
+                swap_dirty_range(core, info, (int)(s_start - b_start), s_count, &d_start, &d_count);
+                hd_submit_sector(device, WRITE, info->table.swap_sec + d_start, d_count, 
+                        info->data + d_start * SECTOR_SIZE, d_count * SECTOR_SIZE, &reqs[j], &aio);
             }
-
-            /* 逐个扇区进行修复 */
-            ret = swap_repair_successive_sectors(device, s_start, s_count);
-            if (0 == ret)
+            else if(NULL != info)
             {
-                /* 修复成功，更新数据 */
-                if(0 == hd_write_sector_retry(device, s_start, s_count, (void*)buf, s_len))
-                {
-                    count -= s_count;
-                    buf += s_len;
-                    buf_size -= s_len;
-                    continue;
-                }
+                // 没有缓存, 直接写映射块
+                atomic64_inc(&core->cache_miss);
+                hd_submit_sg(device, WRITE, info->table.swap_sec + (s_start - b_start), 
+                        s_count, sg, &reqs[j], &aio);
             }
-            else
+            else if(i_bad != i_start+i+j)
             {
-                if (0 != atomic_read(&core->device_dead))
-                {
-                    /* 设备已经不可用，返回 */
-                    goto err;
-                }
+                /* 不是坏块, 直接写磁盘 */
+                hd_submit_sg(device, WRITE, s_start, s_count, sg, &reqs[j], &aio);
             }
 
-            // 坏块, 或者写失败, 需要创建一个交换块
-            info = swap_create(core, s_start, s_count);
-            if(NULL == info)
+            swap_sg_skip(sg, s_count * SECTOR_SIZE);
+        }
+
+        swap_aio_wait(&aio);
+
+        /* 写失败的块和坏块, 逐个处理 */
+        for (j=0; j<n; ++j)
+        {
+            if (0 == reqs[j].result)
             {
-                SWAP_ERR("create swap %llu, %u failed\n", 
-						(unsigned long long)s_start, s_count);
-                goto err;
+                continue;
             }
-            
-            // 更新内存, 然后更新到磁盘
-            if (0 != swap_write(core, info, s_start, s_count, buf, s_len))
+
+            if (hd_result_unsent(reqs[j].result))
             {
-                swap_bitmap_set_bit((unsigned long *)core->head.bitmap, (int)info->table.index, 0);
-                _swap_dealloc_info(info);
+                SWAP_ERR("swap write not submitted %d\n", reqs[j].result);
                 goto err;
             }
-            //SWAP_ERR("find a bad sector %llu, %u, created a swap.\n", s_start, s_count);
 
-            // 加入到链表
-            spin_lock(&core->info_list_lock);
-            list_add_tail(&info->list, &core->info_list);
-            spin_unlock(&core->info_list_lock);
-
-            // 更新table
-            if (0 != flush_swap_info_table(core))
+            if (0 != atomic_read(&core->device_dead))
             {
-                swap_bitmap_set_bit((unsigned long *)core->head.bitmap, (int)info->table.index, 0);
-                _swap_dealloc_info(info);
+                /* 设备已经不可用，返回 */
                 goto err;
             }
 
-            /* 更新总的交换扇区数 */
-            atomic_inc(&core->info_num);
+            swap_block_range(core, start, count, i+j, &b_start, &s_start, &s_count);
+            need_commit = 1;
+            if (NULL != infos[j])
+            {
+                /* 映射块写失败, 读入缓存后同步重写, 再失败会重映射 */
+                ret = swap_write(core, infos[j], s_start, s_count, &pos[j]);
+                if (-DATA_MAY_DIRTY == ret && s_count == core->block_sectors)
+                {
+                    ret = 0;
+                }
+            }
+            else
+            {
+                if (i_bad != i_start+i+j)
+                {
+                    /* 如果写失败，说明还有坏块，继续进行下面的坏块映射 */
+                    SWAP_ERR("hd_write_sector failed\n");
+                }
+                ret = swap_write_create(core, &pos[j], s_start, s_count);
+            }
 
-            /* 当待写的扇区少于一个block时，需要更新 */
-            if (s_count < SECTOR_NUM_PER_SWAP_BLOCK)
+            if (-DATA_MAY_DIRTY == ret)  /* 重映射成功，但数据可能需要更新 */
             {
                 data_dirty = 1;
             }
-            
+            else if (0 != ret)
+            {
+                SWAP_ERR("swap_write fail\n");
+                goto err;
+            }
         }
 
-        //buf_show("after write a swap", buf, buf_size);
-
-        count -= s_count;
-        buf += s_len;
-        buf_size -= s_len;
+        /* 本批新建和重建的映射一起落盘 */
+        if (1 == need_commit && 0 != swap_table_commit(core))
+        {
+            goto err;
+        }
     }
 
     atomic_dec(&core->user);
@@ -2068,6 +2738,184 @@ err:
     return -1;
 }
 
+/* 并发读取n个映射块的数据, 读失败的逐个重建映射, 都加入缓存. 返回重建的个数 */
+static int swap_load_batch(struct scsi_swap_core *core, swap_info_t **infos, int n)
+{
+    struct swap_aio aio;
+    struct swap_aio_req reqs[SWAP_AIO_BATCH];
+    int recreated = 0;
+    int i;
+    struct scsi_device *device = core_to_scsi_device(core);
+
+    swap_aio_init(&aio);
+    for (i = 0; i < n; i++)
+    {
+        hd_submit_sector(device, READ, infos[i]->table.swap_sec, infos[i]->table.sec_size, 
+                infos[i]->data, infos[i]->table.sec_size * SECTOR_SIZE, &reqs[i], &aio);
+    }
+    swap_aio_wait(&aio);
+
+    for (i = 0; i < n; i++)
+    {
+        if (hd_result_unsent(reqs[i].result))
+        {
+            /* 没读成不是坏块, 不缓存, 访问时再读 */
+            swap_cache_put_buf(core, infos[i]->data);
+            infos[i]->data = NULL;
+            continue;
+        }
+
+        if (0 != reqs[i].result)
+        {
+            SWAP_ERR("realloc swap sector\n");
+            if (0 != swap_recreate(core, infos[i]))
+            {
+                /* 不缓存, 访问时再重试 */
+                SWAP_ERR("swap_recreate fail\n");
+                swap_cache_put_buf(core, infos[i]->data);
+                infos[i]->data = NULL;
+                continue;
+            }
+            recreated++;
+        }
+
+        swap_cache_add(core, infos[i]);
+    }
+
+    return recreated;
+}
+
+/*
+ * 预读映射块的数据到缓存, 最多cache_max块. 每次只按源块号顺序
+ * 读一批SWAP_AIO_BATCH个, 由调用者把任务重新排到本盘swap_bio
+ * 队列的队尾, 已经排队的映射IO最多等一批; 没有映射的IO不经过
+ * 这个队列, 不受影响
+ * 返回: 1 还有没读的块, 0 读完了, -1 失败
+ */
+int scsi_swap_core_load(struct scsi_swap_core *core)
+{
+    struct swap_info *info;
+    swap_info_t *infos[SWAP_AIO_BATCH];
+    int got;
+    int n = 0;
+    int i;
+
+    if (core->cache_num >= core->cache_max)
+    {
+        goto done;
+    }
+
+    /* 映射只在本队列里新建和删除, 两批之间查到的info不会被释放 */
+    rcu_read_lock();
+    got = radix_tree_gang_lookup(&core->info_tree, (void **)infos, 
+            core->load_next, SWAP_AIO_BATCH);
+    rcu_read_unlock();
+    if (0 == got)
+    {
+        goto done;
+    }
+
+    for (i = 0; i < got; i++)
+    {
+        info = infos[i];
+        core->load_next = SWAP_BLOCK_INDEX(core, info->table.src_sec) + 1;
+
+        /* 已经被映射IO读入缓存的块跳过 */
+        if (NULL != info->data)
+        {
+            continue;
+        }
+
+        if (core->cache_num + n >= core->cache_max)
+        {
+            break;
+        }
+
+        info->data = kmalloc(SWAP_BLOCK_SIZE(core), GFP_NOIO);
+        if (NULL == info->data)
+        {
+            break;
+        }
+
+        infos[n++] = info;
+    }
+
+    /* 重建的映射一起落盘 */
+    if (0 != n && 0 != swap_load_batch(core, infos, n) 
+            && 0 != swap_table_commit(core))
+    {
+        SWAP_ERR("commit table failed\n");
+        return -1;
+    }
+
+    if (i == got && core->cache_num < core->cache_max)
+    {
+        return 1;
+    }
+
+done:
+    SWAP_ERR("cached %u of %d swap blocks\n", core->cache_num, atomic_read(&core->info_num));
+    return 0;
+}
+
+/* 映射块数据缓存的使用情况 */
+int scsi_swap_core_cache_show(struct scsi_swap_core *core, char *page)
+{
+    /* cache_num只在本盘swap_bio队列里改, 这里读一次快照 */
+    u32 num = ACCESS_ONCE(core->cache_num);
+
+    return sprintf(page, "blocks %u\nmax_blocks %u\nbytes %lu\nhits %llu\nmisses %llu\n", 
+            num, core->cache_max, 
+            (unsigned long)num * SWAP_BLOCK_SIZE(core), 
+            (unsigned long long)atomic64_read(&core->cache_hit), 
+            (unsigned long long)atomic64_read(&core->cache_miss));
+}
+
+/*
+ * 二进制映射表, 每个映射一条scsi_swap_table_rec, 返回从off开始的count字节.
+ * 持info_list_mutex复制记录, swap_recreate在锁下改表项, 每条记录都是完整的
+ */
+ssize_t scsi_swap_core_read_table(struct scsi_swap_core *core, char *buf, loff_t off, size_t count)
+{
+    struct swap_info *info;
+    struct scsi_swap_table_rec rec;
+    loff_t pos = 0;
+    size_t done = 0;
+    size_t skip;
+    size_t len;
+
+    mutex_lock(&core->info_list_mutex);
+    list_for_each_entry(info, &core->info_list, list)
+    {
+        if (pos + sizeof(rec) <= off)
+        {
+            pos += sizeof(rec);
+            continue;
+        }
+
+        memset(&rec, 0, sizeof(rec));
+        rec.src_sec = info->table.src_sec;
+        rec.swap_sec = info->table.swap_sec;
+        rec.sec_size = info->table.sec_size;
+        rec.index = info->table.index;
+
+        /* 第一条可能从记录中间开始 */
+        skip = (size_t)(off + done - pos);
+        len = min(sizeof(rec) - skip, count - done);
+        memcpy(buf + done, (char *)&rec + skip, len);
+        done += len;
+        pos += sizeof(rec);
+
+        if (done == count)
+        {
+            break;
+        }
+    }
+    mutex_unlock(&core->info_list_mutex);
+
+    return done;
+}
+
 int scsi_swap_core_show(struct scsi_swap_core *core, char *page)
 {
 	struct swap_info *info;
@@ -2075,7 +2923,7 @@ int scsi_swap_core_show(struct scsi_swap_core *core, char *page)
 	int len;
 	int left = PAGE_SIZE;
 
-    spin_lock(&core->info_list_lock);
+    mutex_lock(&core->info_list_mutex);
     list_for_each_entry(info, &core->info_list, list) {
 		len = snprintf(buf, sizeof(buf), "%llu %llu %u\n", 
 				(unsigned long long)info->table.src_sec, 
@@ -2085,7 +2933,7 @@ int scsi_swap_core_show(struct scsi_swap_core *core, char *page)
 		strcpy(page+(PAGE_SIZE-left), buf);
 		left -= len;
 	}
-    spin_unlock(&core->info_list_lock);
+    mutex_unlock(&core->info_list_mutex);
 
 	return PAGE_SIZE-left;
 }
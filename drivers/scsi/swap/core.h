@@ -14,17 +14,23 @@
 #define _BLK_SWAP_CORE_H
 
 #include <linux/types.h>
+#include <linux/radix-tree.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
 #include <scsi/scsi_device.h>
 
 #include "log.h"
 
+struct swap_sg;
+
 #define SECTOR_SIZE                 512
 #define SECTOR_1M                   (2*1024)        /* 1M空间所占的扇区 */
-#define SECTOR_NUM_PER_SWAP_BLOCK   128             /* 每个替换块的扇区数, 128扇区，64K */
+#define SECTOR_NUM_PER_SWAP_BLOCK   128             /* 每个替换块最大的扇区数, 128扇区，64K, 旧的头都是这个值 */
+#define SWAP_BLOCK_SECTORS_MIN      8               /* 每个替换块最小的扇区数, 8扇区，4K */
 #define MAX_RESERVED_SECTOR         (SECTOR_1M*1024)/* 先预留，做兼容, 1024M */ 
 
 #define DATA_SECTOR                 (SECTOR_1M*64)  /* 保留数据空间扇区数, 64M */
-#define DATA_BLOCK_NUM              (DATA_SECTOR/SECTOR_NUM_PER_SWAP_BLOCK)     /* 保留空间block数, 1024 */
+#define DATA_BLOCK_NUM              (DATA_SECTOR/SECTOR_NUM_PER_SWAP_BLOCK)     /* 保留空间block数, 1024, 块小于64K时只用数据区的前面一部分 */
 #define DATA_MAY_DIRTY				0xaa
 
 /* SWAP HEAD INFO */
@@ -36,16 +42,17 @@
 										-SWAP_HEAD_STRING_LEN	\
 										-SWAP_HEAD_STATUS_LEN	\
 										-SWAP_HEAD_VERSION_LEN	\
-										-(4*SWAP_HEAD_BITMAP_LEN)-4)
+										-(4*SWAP_HEAD_BITMAP_LEN)-4-4)
 
-#define SWAP_VERSION                    "0001"
+#define SWAP_VERSION_0001               "0001"          /* 64字节表项, 最多MAX_SWAP_BLOCK_FOR_USE个映射 */
+#define SWAP_VERSION                    "0002"          /* 16字节表项, 整个数据区DATA_BLOCK_NUM个块都可以映射 */
 #define SECTOR_8M                       (16*1024)       /* 8M空间所占的扇区 */
-#define MAX_SWAP_BLOCK_FOR_USE          128             /* 最多能用的交换block, 128个 */
+#define MAX_SWAP_BLOCK_FOR_USE          128             /* 0001格式最多能用的交换block, 128个 */
 #define SWAP_HEAD_STRING                "DHSWAP"        /* 映射功能头在SWAP_HEAD_OFFEST位置固定字符表示支持映射功能 */
 #define SWAP_HEAD_OFFEST                SECTOR_8M       /* 存放SWAP_HEAD_STRU的偏移地址相对于保留空间,前8M保留不用 */
 #define SWAP_HEAD_N_SECTOR              8               /* SWAP_HEAD占的扇区数 */
 #define SWAP_TABLE_OFFSET               (2*SECTOR_8M)   /* 存放swap映射表 的扇区偏移地址，相对于保留空间  */
-#define SWPA_TABLE_N_SECTOR             32              /* SWAP_TALBE占的扇区数，每个扇区8个block信息，128个block，需要16个扇区 */
+#define SWPA_TABLE_N_SECTOR             32              /* SWAP_TALBE占的扇区数，0001每个扇区8个block信息，0002每个扇区32个，正好1024个 */
 #define SWAP_DATA_OFFSET                (3*SECTOR_8M)   /* 数据从第24M开始 */
 #define SWAP_HEAD_BACKUP_OFFEST         64              /* 存放SWAP_HEAD_STRU的偏移地址相对于SWAP_HEAD */
 #define SWAP_HEAD_BACKUP_N_SECTOR       8               /* SWAP_HEAD占的扇区数 */
@@ -60,22 +67,24 @@
 #define SWAP_LOG_HEAD_SECTOR_COUNT	32 // must smaller than SECTOR_1M(2048)， 32 means 32*16 == 512 of log
 #define SWAP_LOG_DATA_OFFSET		(SWAP_LOG_HEAD_OFFSET+SECTOR_1M)
 
-#define SWAP_BLOCK_INDEX(sector)        ((sector)/SECTOR_NUM_PER_SWAP_BLOCK)        /* 128扇区对齐索引号 */
-#define SWAP_BLOCK_SECTOR(i)            ((i)*SECTOR_NUM_PER_SWAP_BLOCK)             /* 128扇区对齐索引号对应的扇区号 */
-#define SWAP_SECTOR_ALIGN(sector)       (SWAP_BLOCK_SECTOR(SWAP_BLOCK_INDEX(sector)))
+/* 替换块大小每个盘不同, 记录在头里, 见core->block_sectors */
+#define SWAP_BLOCK_INDEX(core, sector)  ((sector) >> (core)->block_shift)           /* 块对齐索引号 */
+#define SWAP_BLOCK_SECTOR(core, i)      ((sector_t)(i) << (core)->block_shift)      /* 块对齐索引号对应的扇区号 */
+#define SWAP_SECTOR_ALIGN(core, sector) (SWAP_BLOCK_SECTOR(core, SWAP_BLOCK_INDEX(core, sector)))
 
-#define SWAP_BLOCK_SIZE                 (SECTOR_NUM_PER_SWAP_BLOCK * SECTOR_SIZE)
+#define SWAP_BLOCK_SIZE(core)           ((core)->block_sectors * SECTOR_SIZE)
+#define SWAP_BLOCK_MAX_SIZE             (SECTOR_NUM_PER_SWAP_BLOCK * SECTOR_SIZE)
 
 #define SWAP_REASSIGN_BLKS_CMDLEN       6
 #define SWAP_MAX_REASSIGN_BLKS_NUM      1024
 
-#define swap_for_each_blk(blk_start, sector_start, sector_count)    \
-    for(sector_t blk_start=SWAP_SECTOR_ALIGN(sector_start);         \
-        blk_start<SWAP_SECTOR_ALIGN(sector_start+sector_count);     \
-        blk_start += SECTOR_NUM_PER_SWAP_BLOCK)
+#define swap_for_each_blk(core, blk_start, sector_start, sector_count)    \
+    for(sector_t blk_start=SWAP_SECTOR_ALIGN(core, sector_start);         \
+        blk_start<SWAP_SECTOR_ALIGN(core, sector_start+sector_count);     \
+        blk_start += (core)->block_sectors)
 
-#define swap_next_blk(sector_start)    \
-    (SWAP_SECTOR_ALIGN(SWAP_BLOCK_SECTOR(SWAP_BLOCK_INDEX(sector_start)+1)))
+#define swap_next_blk(core, sector_start)    \
+    (SWAP_BLOCK_SECTOR(core, SWAP_BLOCK_INDEX(core, sector_start)+1))
 
 // 512字节
 typedef struct swap_head {
@@ -83,6 +92,7 @@ typedef struct swap_head {
     char status[SWAP_HEAD_STATUS_LEN];          /* swap头的状态，valid:有效 invalid:无效 */
     char version[SWAP_HEAD_VERSION_LEN];        /* swap 版本号 */
     u32 bitmap[SWAP_HEAD_BITMAP_LEN];           /* 1024 bit */
+    u32 block_sectors;                          /* 替换块扇区数, 格式化时确定, 0 表示旧的头, 128扇区 */
     char reserved[SWAP_HEAD_RESERVE_LEN];       /* 不使用，需要清0 */
     u32 checksum;                               /* 校验和 */
 } swap_head_t;
@@ -93,9 +103,29 @@ struct scsi_swap_core {
     atomic_t info_num;
     atomic_t user;
     struct swap_head head;
-    struct list_head info_list;
-	spinlock_t info_list_lock;
-    spinlock_t bitmap_lock;
+    u32 table_version;              /* 盘上映射表格式, 1: 0001, 2: 0002 */
+    u32 block_sectors;              /* 替换块扇区数, 来自头 */
+    u32 block_shift;                /* ilog2(block_sectors) */
+    u32 phys_sectors;               /* 物理块扇区数, 元数据和映射块的读写都按它对齐 */
+    struct list_head info_list;     /* 映射表顺序, 刷表时按此顺序写盘 */
+    struct radix_tree_root info_tree;   /* SWAP_BLOCK_INDEX -> swap_info, 查找用 */
+    struct mutex info_list_mutex;   /* 写者和改表项的互斥, 查找用RCU不加锁, 要完整表项的加锁 */
+    struct mutex bitmap_mutex;
+    char *zero_block;               /* 预分配的全0块, 只读, 检测新映射块时写盘用 */
+    struct mutex commit_mutex;      /* 映射表落盘, 多次新建映射合并成一次提交 */
+    char *table_disk;               /* 盘上的映射表, 提交时只写和它不同的扇区 */
+    char *table_buf;                /* 提交时生成的映射表 */
+    char *head_buf;                 /* 读写头用, 一个物理块 */
+    u32 head_disk_bitmap[SWAP_HEAD_BITMAP_LEN];    /* 盘上头的bitmap */
+    bool head_stale;                /* 盘上主备头的版本号可能不一致, 提交前要重写 */
+
+    struct list_head cache_lru;     /* 有数据缓存的映射块, 最近用过的在前 */
+    u32 cache_num;                  /* 缓存的块数 */
+    u32 cache_max;                  /* 最多缓存的块数, 模块参数swap_cache_blocks */
+    unsigned long load_next;        /* 后台预读的游标, 下一个源块号 */
+    char *cache_spare;              /* 预留的一块缓存, 分配失败又没有可挤出的块时用 */
+    atomic64_t cache_hit;           /* sysfs读时不加锁 */
+    atomic64_t cache_miss;
 
     sector_t capacity;              /* size in 512-byte sectors */
     sector_t sector_reserve_start;
@@ -107,11 +137,14 @@ struct scsi_swap_core {
 
 int scsi_swap_core_init(struct scsi_swap_core *core, sector_t reserve_sector);
 int scsi_swap_core_destroy(struct scsi_swap_core *core);
-int scsi_swap_core_read(struct scsi_swap_core *core, sector_t src, u32 num, sector_t bad, void *buf, u32 len); 
-int scsi_swap_core_write(struct scsi_swap_core *core, sector_t src, u32 num, sector_t bad, const void *buf, u32 len); 
+int scsi_swap_core_load(struct scsi_swap_core *core);
+int scsi_swap_core_read(struct scsi_swap_core *core, sector_t src, u32 num, sector_t bad, struct swap_sg *sg); 
+int scsi_swap_core_write(struct scsi_swap_core *core, sector_t src, u32 num, sector_t bad, struct swap_sg *sg); 
 int scsi_swap_core_can_swap(struct scsi_swap_core *core, sector_t sector, u32 num);
 int scsi_swap_core_swapped(struct scsi_swap_core *core, sector_t sector, u32 num);
 int scsi_swap_core_show(struct scsi_swap_core *core, char *page);
+ssize_t scsi_swap_core_read_table(struct scsi_swap_core *core, char *buf, loff_t off, size_t count);
+int scsi_swap_core_cache_show(struct scsi_swap_core *core, char *page);
 
 #endif
 
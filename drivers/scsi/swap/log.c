@@ -16,12 +16,17 @@
 #include "crc32.h"
 
 #include <linux/crc32.h>
+#include <linux/math64.h>
+
+#include <trace/events/scsi_swap.h>
 
 // The initial CRC32 value used when calculating CRC checksums
 #define LOG_CRC32_INIT 0xFFFFFFFFU
 #define LOG_MAX_SECTOR_NUM 32								// 32*(512/32) = 32个扇区512条log
 #define LOG_ITEM_SIZE (sizeof(struct scsi_swap_log_item))		// 一个条LOG 32字节
 #define LOG_COUNT_PER_SECTOR (SECTOR_SIZE/LOG_ITEM_SIZE)	// 一个扇区16条LOG
+#define LOG_FLUSH_DELAY (HZ/10)								// 新log最多等100ms落盘
+#define LOG_RETRY_MAX_DELAY (60*HZ)							// 写失败后最长1分钟重试一次
 
 /* 32 bytes */
 struct scsi_swap_log_item {
@@ -55,57 +60,138 @@ static u32 scsi_swap_log_crc_item(struct scsi_swap_log_item *item)
 			sizeof(*item) - 4);
 }
 
-static int scsi_swap_log_update_data(struct scsi_swap_log *log, struct scsi_swap_log_item *item)
+// 日志按物理块读写, 和头, 映射表一样
+static inline int log_io_sectors(struct scsi_swap_log *log)
 {
-	struct scsi_device *sdev;
-	struct scsi_swap *swap;
-	
-	char *base;
-	char *start;
-	char *data;
-	sector_t sector;
-	int i_sector;
-	
-	swap = container_of(log, struct swap_handler, log)->swap;
-	sdev = container_of(swap, struct scsi_device, swap);
+	return log_to_swap_handler(log)->core.phys_sectors;
+}
 
-	sdev = log_to_scsi_device(log);
+// [slot, slot+num)这些log所在的物理块, 按扇区算, 不跨过缓冲末尾
+static void scsi_swap_log_slots_range(struct scsi_swap_log *log, int slot, int num, 
+		int *first, int *last)
+{
+	int unit = log_io_sectors(log);
 
-	
-	base = (char *)cspring_buffer(log->ring);
+	*first = round_down(slot * (int)LOG_ITEM_SIZE / SECTOR_SIZE, unit);
+	*last = round_up(((slot + num) * (int)LOG_ITEM_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE, unit);
+}
 
-	spin_lock(&log->lock);
-	start = (char *)cspring_push(log->ring, item);
-	spin_unlock(&log->lock);
+// 持有log->lock, 把这些log所在的物理块从环形缓冲复制到write_buf的同一位置
+static void scsi_swap_log_copy_slots(struct scsi_swap_log *log, int slot, int num)
+{
+	char *base = (char *)cspring_buffer(log->ring);
+	int first;
+	int last;
 
-	i_sector = (start - base) / SECTOR_SIZE;
+	scsi_swap_log_slots_range(log, slot, num, &first, &last);
+	memcpy(log->write_buf + first * SECTOR_SIZE, base + first * SECTOR_SIZE, 
+			(last - first) * SECTOR_SIZE);
+}
 
-	sector = log->sector_data + i_sector;
-	data = base + i_sector;
-	
-	// When i_sector is the last ring sector, 
-	// we will write some garbage which will nerver be accessed, 
-	// so it's ok, harmless.
-	return hd_write_sector_no_retry(sdev, sector, 1, data, SECTOR_SIZE);
+// 写write_buf里[slot, slot+num)这些log所在的物理块
+static int scsi_swap_log_write_slots(struct scsi_swap_log *log, int slot, int num)
+{
+	struct scsi_device *sdev = log_to_scsi_device(log);
+	int first;
+	int last;
+
+	scsi_swap_log_slots_range(log, slot, num, &first, &last);
+
+	return hd_write_sector_no_retry(sdev, log->sector_data + first, last - first, 
+			log->write_buf + first * SECTOR_SIZE, (last - first) * SECTOR_SIZE);
 }
 
-static int scsi_swap_log_update_head(struct scsi_swap_log *log)
+static int scsi_swap_log_update_head(struct scsi_swap_log *log, int item_num, int item_next)
 {
-	char buf[SECTOR_SIZE] = {0};
+	char *buf = log->head_buf;
 	sector_t sector;
 	struct scsi_device *sdev = log_to_scsi_device(log);
+	int unit = log_io_sectors(log);
 
-	// log count and next postion will change after pushed or poped
-	log->head.item_num = cspring_num(log->ring);
-	log->head.item_next = cspring_next(log->ring);
+	// 只记录已经落盘的log
+	log->head.item_num = item_num;
+	log->head.item_next = item_next;
 	log->head.crc = scsi_swap_log_crc_head(log);
 
 	sector = log->sector_head;
+	memset(buf, 0, unit * SECTOR_SIZE);
 	memcpy(buf, &log->head, sizeof(log->head));
 
 	//SWAP_INFO("writting head sector %llu, crc %u, num %d, next %d\n",
 	//		sector, log->head.crc, log->head.item_num, log->head.item_next);
-	return hd_write_sector_no_retry(sdev, sector, 1, buf, SECTOR_SIZE);
+	return hd_write_sector_no_retry(sdev, sector, unit, buf, unit * SECTOR_SIZE);
+}
+
+/*
+ * 后台写log: 把上次之后新加的log一次写下去, 再写一次头. 
+ * 先写数据后写头, 头里的log都已经在盘上, 中途掉电不会引用没写的log. 
+ * 写失败的log留到下次再写, 间隔从LOG_FLUSH_DELAY开始加倍重试.
+ * 要写的块在锁内复制到write_buf, 锁外写副本, 写的时候push改环形缓冲不影响.
+ */
+static void scsi_swap_log_work_handler(struct work_struct *work)
+{
+	struct scsi_swap_log *log = container_of(to_delayed_work(work), 
+			struct scsi_swap_log, work);
+	int cap = cspring_cap(log->ring);
+	int item_num;
+	int item_next;
+	int dirty;
+	int slot;
+	int ret = 0;
+	struct scsi_swap_stats *stats = log_to_swap_stats(log);
+	ktime_t start = ktime_get();
+
+	spin_lock(&log->lock);
+	item_num = cspring_num(log->ring);
+	item_next = cspring_next(log->ring);
+	dirty = log->dirty;
+	log->dirty = 0;
+
+	// 脏的是最新的dirty条, 结束于item_next, 回绕时分两段
+	slot = (item_next - dirty + cap) % cap;
+	if (dirty != 0) {
+		if (slot + dirty > cap) {
+			scsi_swap_log_copy_slots(log, slot, cap - slot);
+			scsi_swap_log_copy_slots(log, 0, slot + dirty - cap);
+		} else {
+			scsi_swap_log_copy_slots(log, slot, dirty);
+		}
+	}
+	spin_unlock(&log->lock);
+
+	if (dirty == 0)
+		return;
+
+	if (slot + dirty > cap) {
+		ret |= scsi_swap_log_write_slots(log, slot, cap - slot);
+		ret |= scsi_swap_log_write_slots(log, 0, slot + dirty - cap);
+	} else {
+		ret |= scsi_swap_log_write_slots(log, slot, dirty);
+	}
+
+	if (ret == 0)
+		ret = scsi_swap_log_update_head(log, item_num, item_next);
+
+	swap_stat_inc(stats, SWAP_STAT_LOG_FLUSH);
+	swap_stat_latency(stats, SWAP_LAT_LOG_FLUSH, start);
+	trace_scsi_swap_log_flush(log_to_devt(log), ret, start);
+	if (ret == 0) {
+		log->retry_delay = 0;
+		return;
+	}
+
+	SWAP_ERR("write %d logs to disk failed\n", dirty);
+
+	spin_lock(&log->lock);
+	log->dirty = min(log->dirty + dirty, cap);
+	spin_unlock(&log->lock);
+
+	if (log->dying)
+		return;
+
+	log->retry_delay = log->retry_delay ? 
+		min(log->retry_delay * 2, (unsigned long)LOG_RETRY_MAX_DELAY) : LOG_FLUSH_DELAY;
+	schedule_delayed_work(&log->work, log->retry_delay);
 }
 
 static struct scsi_swap_log_item *scsi_swap_log_peek(struct scsi_swap_log *log, int index)
@@ -129,13 +215,14 @@ static int scsi_swap_log_load(struct scsi_swap_log *log)
 {
 	struct scsi_device *sdev = log_to_scsi_device(log);
 
-	char buf[SECTOR_SIZE];
+	char *buf = log->head_buf;
 	char *data;
 	u32 crc;
 	int len;
+	int unit = log_io_sectors(log);
 
 	// read log head
-	if (hd_read_sector_no_retry(sdev, log->sector_head, 1, buf, sizeof(buf)) == -1) {
+	if (hd_read_sector_no_retry(sdev, log->sector_head, unit, buf, unit * SECTOR_SIZE) == -1) {
 		SWAP_ERR("read swap log head [sector:%llu] failed\n", 
 				(unsigned long long)log->sector_head);
 		return -1;
@@ -163,6 +250,12 @@ int scsi_swap_log_init(struct scsi_swap_log *log, sector_t head, sector_t data)
 	struct gendisk *gd;
 
 	BUG_ON(sizeof(log->head) > SECTOR_SIZE);
+
+	log->dirty = 0;
+	log->retry_delay = 0;
+	log->dying = false;
+	spin_lock_init(&log->lock);
+	INIT_DELAYED_WORK(&log->work, scsi_swap_log_work_handler);
 	
 	log->ring = cspring_create(sizeof(struct scsi_swap_log_item), 
 			LOG_MAX_SECTOR_NUM * LOG_COUNT_PER_SECTOR);
@@ -171,6 +264,19 @@ int scsi_swap_log_init(struct scsi_swap_log *log, sector_t head, sector_t data)
 		return -1;
 	}
 
+	log->head_buf = kzalloc(SWAP_HEAD_N_SECTOR * SECTOR_SIZE, GFP_KERNEL);
+	log->write_buf = kzalloc(LOG_MAX_SECTOR_NUM * SECTOR_SIZE, GFP_KERNEL);
+	if (log->head_buf == NULL || log->write_buf == NULL) {
+		SWAP_ERR("alloc log buffer failed\n");
+		kfree(log->head_buf);
+		kfree(log->write_buf);
+		log->head_buf = NULL;
+		log->write_buf = NULL;
+		cspring_destroy(log->ring);
+		log->ring = NULL;
+		return -1;
+	}
+
 	log->sector_head = head;
 	log->sector_data = data;
 	
@@ -188,15 +294,23 @@ int scsi_swap_log_init(struct scsi_swap_log *log, sector_t head, sector_t data)
 	log->ring->item_num = log->head.item_num;
 	log->ring->item_next = log->head.item_next;
 
-	spin_lock_init(&log->lock);
-
 	return 0;
 }
 
 int scsi_swap_log_destroy(struct scsi_swap_log *log)
 {
+	// 停掉后台写和重试, 还没写下去的log同步写一次再释放
+	spin_lock(&log->lock);
+	log->dying = true;
+	spin_unlock(&log->lock);
+	cancel_delayed_work_sync(&log->work);
+	if (log->dirty != 0)
+		scsi_swap_log_work_handler(&log->work.work);
+
 	if (log->ring)
 		cspring_destroy(log->ring);
+	kfree(log->head_buf);
+	kfree(log->write_buf);
 	return 0;
 }
 
@@ -253,47 +367,85 @@ int scsi_swap_log_push(struct scsi_swap_log *log, enum LOG_TYPE type, u8 result,
 
 	// 直接从ringbuffer里面拿到指针，再用指针填充可能效率更好点
 	// 不过这里效率没有那么重要，还是简单点, 先准备好，再复制进去。
+	spin_lock(&log->lock);
 	scsi_swap_log_item_init(log, &item, type, result, src, dst, count);
+	cspring_push(log->ring, &item);
+	log->dirty = min(log->dirty + 1, cspring_cap(log->ring));
+	spin_unlock(&log->lock);
 
-	// update data and write to disk
-	if (scsi_swap_log_update_data(log, &item) == -1) {
-		SWAP_ERR("write log to disk failed\n");
-		return -1;
-	}
-
-	// update head and write to disk
-	if (scsi_swap_log_update_head(log) == -1) {
-		SWAP_ERR("write log head to disk failed\n");
-		return -1;
-	}
+	// 不在映射路径上写盘, 一段时间内的log由后台合并写
+	if (!log->dying)
+		schedule_delayed_work(&log->work, LOG_FLUSH_DELAY);
 
+	trace_scsi_swap_log_push(log_to_devt(log), type, result, src, dst, count);
 	scsi_swap_log_item_dump(&item);
 
 	return 0;
 }
 
+// 人看的文本格式, 最多一页, 完整的log用log_bin
 int scsi_swap_log_show(struct scsi_swap_log *log, char *page)
 {
 	struct scsi_swap_log_item *item;
+	struct scsi_swap_log_item copy;
 	char buf[256];
 	int len;
 	int left = PAGE_SIZE;
 	int i = 0;
 
-	// 打印prepare
-	spin_lock(&log->lock);
-	while ((item = scsi_swap_log_peek(log, i++))) {
+	// 锁内只复制一条, 锁外格式化
+	for (;;) {
+		spin_lock(&log->lock);
+		item = scsi_swap_log_peek(log, i++);
+		if (item)
+			copy = *item;
+		spin_unlock(&log->lock);
+		if (!item)
+			break;
+
 		len = snprintf(buf, sizeof(buf), "%u %llu %llu %u %d %d %d %d %d\n", 
-				item->time, item->sec_src, item->sec_dst, item->sec_count,
-				item->type, item->result, item->reboot_count, item->fix_count, 
-				item->curr_count);
+				copy.time, copy.sec_src, copy.sec_dst, copy.sec_count,
+				copy.type, copy.result, copy.reboot_count, copy.fix_count, 
+				copy.curr_count);
 		if (left <= len)
 			break;
 		strcpy(page+(PAGE_SIZE-left), buf);
 		left -= len;
 	}
-	spin_unlock(&log->lock);
 
 	return PAGE_SIZE-left;
 }
 
+// 二进制log, 每条一个scsi_swap_log_rec, 从旧到新, 返回从off开始的count字节
+ssize_t scsi_swap_log_read(struct scsi_swap_log *log, char *buf, loff_t off, size_t count)
+{
+	struct scsi_swap_log_item *item;
+	struct scsi_swap_log_rec rec;
+	int i = (int)div_u64(off, sizeof(rec));
+	size_t skip = (size_t)(off - (loff_t)i * sizeof(rec));
+	size_t done = 0;
+	size_t len;
+
+	spin_lock(&log->lock);
+	while (done < count && (item = scsi_swap_log_peek(log, i++))) {
+		memset(&rec, 0, sizeof(rec));
+		rec.sec_src = item->sec_src;
+		rec.sec_dst = item->sec_dst;
+		rec.time = item->time;
+		rec.sec_count = item->sec_count;
+		rec.type = item->type;
+		rec.result = item->result;
+		rec.reboot_count = item->reboot_count;
+		rec.fix_count = item->fix_count;
+		rec.curr_count = item->curr_count;
+
+		len = min(sizeof(rec) - skip, count - done);
+		memcpy(buf + done, (char *)&rec + skip, len);
+		done += len;
+		skip = 0;
+	}
+	spin_unlock(&log->lock);
+
+	return done;
+}
+
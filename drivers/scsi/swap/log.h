@@ -12,6 +12,8 @@
 #ifndef _SCSI_SWAP_LOG_H
 #define _SCSI_SWAP_LOG_H
 
+#include <linux/workqueue.h>
+
 #define LOG_SUCCESS 0
 #define LOG_FAILED 1
 
@@ -45,9 +47,15 @@ struct scsi_swap_log_head {
 struct scsi_swap_log {
 	struct scsi_swap_log_head head;
 	struct cspring *ring;
+	char *head_buf;		/* 读写日志头用, 一个物理块 */
+	char *write_buf;	/* 后台写log用, 锁内从环形缓冲复制, 和缓冲一样大 */
 	sector_t sector_head;
 	sector_t sector_data;
 	spinlock_t lock;
+	int dirty;					/* 最新的dirty条log还没落盘 */
+	struct delayed_work work;	/* 后台写log */
+	unsigned long retry_delay;	/* 写失败后重试的间隔, 每次失败加倍 */
+	bool dying;					/* 正在销毁, 不再排后台写 */
 };
 
 int scsi_swap_log_init(struct scsi_swap_log *log, sector_t head, sector_t data);
@@ -55,5 +63,6 @@ int scsi_swap_log_destroy(struct scsi_swap_log *log);
 int scsi_swap_log_push(struct scsi_swap_log *log, enum LOG_TYPE type, u8 result, 
 		sector_t src, sector_t dst, u16 count);
 int scsi_swap_log_show(struct scsi_swap_log *log, char *page);
+ssize_t scsi_swap_log_read(struct scsi_swap_log *log, char *buf, loff_t off, size_t count);
 
 #endif
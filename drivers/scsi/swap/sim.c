@@ -9,116 +9,482 @@
  *         Modify:  
  * =====================================================================================
  */
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/timer.h>
+#include <linux/blkdev.h>
+#include <scsi/scsi_cmnd.h>
+
 #include "swap.h"
 
-struct sim_node {
-	struct list_head entry;
+#include <trace/events/scsi.h>
+
+struct sim_range {
 	sector_t start;
+	sector_t end;		/* 最后一个扇区 */
+	sector_t max_end;	/* ranges[0..i]里最大的end, 查找用 */
 	u32 num;
-	int rw;
+	u32 percent;		/* 失败的概率, 0~100 */
+	u32 delay_ms;		/* 推迟完成, 模拟慢扇区 */
 };
 
-static bool sectorA_hit_sectorB(sector_t Astart, sector_t Aend, sector_t Bstart, sector_t Bend)
+struct sim_table {
+	struct rcu_head rcu;
+	struct list_head free_entry;	/* vmalloc的表挂在sim->free_list上等工作队列释放 */
+	struct scsi_swap_sim *sim;
+	int num;
+	struct sim_range ranges[0];
+};
+
+/* 推迟完成的命令, 挂在sim->delay_list上 */
+struct sim_delay {
+	struct list_head entry;
+	struct timer_list timer;
+	struct scsi_swap_sim *sim;
+	struct scsi_cmnd *scmd;
+};
+
+// 上千个区间时一次要几十K, 大了用vmalloc
+static struct sim_table *sim_table_alloc(int num)
+{
+	size_t size = sizeof(struct sim_table) + num * sizeof(struct sim_range);
+	struct sim_table *table;
+
+	if (size <= PAGE_SIZE)
+		table = kmalloc(size, GFP_KERNEL);
+	else
+		table = vmalloc(size);
+	if (table) {
+		table->num = num;
+		INIT_LIST_HEAD(&table->free_entry);
+		table->sim = NULL;
+	}
+
+	return table;
+}
+
+static void sim_table_free(struct sim_table *table)
 {
-    return ((Astart >= Bstart)&&(Astart <= Bend))
-        || ((Aend >= Bstart)&&(Aend <= Bend))
-        || ((Astart <= Bstart)&&(Aend >= Bend));
+	if (is_vmalloc_addr(table))
+		vfree(table);
+	else
+		kfree(table);
 }
 
+// RCU回调在软中断里, 不能vfree, 交给工作队列
+static void sim_table_free_rcu(struct rcu_head *head)
+{
+	struct sim_table *table = container_of(head, struct sim_table, rcu);
+	struct scsi_swap_sim *sim = table->sim;
+
+	if (!is_vmalloc_addr(table)) {
+		kfree(table);
+		return;
+	}
+
+	spin_lock(&sim->free_lock);
+	list_add_tail(&table->free_entry, &sim->free_list);
+	spin_unlock(&sim->free_lock);
+	schedule_work(&sim->free_work);
+}
+
+static void sim_table_free_work(struct work_struct *work)
+{
+	struct scsi_swap_sim *sim = container_of(work, struct scsi_swap_sim, free_work);
+	struct sim_table *table;
+	struct sim_table *next;
+	LIST_HEAD(list);
+
+	spin_lock_bh(&sim->free_lock);
+	list_splice_init(&sim->free_list, &list);
+	spin_unlock_bh(&sim->free_lock);
+
+	list_for_each_entry_safe(table, next, &list, free_entry)
+		vfree(table);
+}
+
+static void sim_table_calc_max_end(struct sim_table *table)
+{
+	int i;
+
+	for (i = 0; i < table->num; i++) {
+		table->ranges[i].max_end = table->ranges[i].end;
+		if (i > 0 && table->ranges[i-1].max_end > table->ranges[i].max_end)
+			table->ranges[i].max_end = table->ranges[i-1].max_end;
+	}
+}
+
+// 本盘有没有区间变化时, 打开或关闭scsi_done里的钩子, 调用者持有sim->lock
+static void sim_update_key(struct scsi_swap_sim *sim)
+{
+	bool active = false;
+	int rw;
+
+	for (rw = SIM_READ; rw <= SIM_WRITE; rw++) {
+		if (rcu_dereference_protected(sim->table[rw], 
+					lockdep_is_held(&sim->lock))->num > 0)
+			active = true;
+	}
+
+	if (active == sim->active)
+		return;
+
+	sim->active = active;
+	if (active)
+		static_key_slow_inc(&scsi_swap_sim_key);
+	else
+		static_key_slow_dec(&scsi_swap_sim_key);
+}
+
+// 新表替换旧表, 旧表过了宽限期再释放, 不在锁里等; 调用者持有sim->lock
+static void sim_table_replace(struct scsi_swap_sim *sim, int rw, struct sim_table *table)
+{
+	struct sim_table *old = rcu_dereference_protected(sim->table[rw],
+			lockdep_is_held(&sim->lock));
+
+	sim_table_calc_max_end(table);
+	rcu_assign_pointer(sim->table[rw], table);
+	sim_update_key(sim);
+	old->sim = sim;
+	call_rcu(&old->rcu, sim_table_free_rcu);
+}
 
 int scsi_swap_sim_init(struct scsi_swap_sim *sim)
 {
-	spin_lock_init(&sim->list_lock);
-	INIT_LIST_HEAD(&sim->list);
+	struct sim_table *read;
+	struct sim_table *write;
+
+	read = sim_table_alloc(0);
+	write = sim_table_alloc(0);
+	if (!read || !write) {
+		kfree(read);
+		kfree(write);
+		return -1;
+	}
+
+	mutex_init(&sim->lock);
+	sim->active = false;
+	INIT_LIST_HEAD(&sim->delay_list);
+	spin_lock_init(&sim->delay_lock);
+	sim->dying = false;
+	INIT_LIST_HEAD(&sim->free_list);
+	spin_lock_init(&sim->free_lock);
+	INIT_WORK(&sim->free_work, sim_table_free_work);
+	atomic_set(&sim->delay_skipped, 0);
+	RCU_INIT_POINTER(sim->table[SIM_READ], read);
+	RCU_INIT_POINTER(sim->table[SIM_WRITE], write);
 	return 0;
 }
 
+static void sim_delay_complete(struct scsi_cmnd *scmd)
+{
+	trace_scsi_dispatch_cmd_done(scmd);
+	blk_complete_request(scmd->request);
+}
+
+static void sim_delay_done(unsigned long data)
+{
+	struct sim_delay *delay = (struct sim_delay *)data;
+	struct scsi_swap_sim *sim = delay->sim;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->delay_lock, flags);
+	// 已经被scsi_swap_sim_destroy取走, 由它完成命令
+	if (list_empty(&delay->entry)) {
+		spin_unlock_irqrestore(&sim->delay_lock, flags);
+		return;
+	}
+	list_del_init(&delay->entry);
+	spin_unlock_irqrestore(&sim->delay_lock, flags);
+
+	sim_delay_complete(delay->scmd);
+	kfree(delay);
+}
+
+/* 
+ * 延迟的上限, 配置时和完成时都用它: 要远小于请求超时(jiffies), 
+ * 不然超时处理会先结束命令
+ */
+bool scsi_swap_sim_delay_ok(unsigned int timeout, u32 delay_ms)
+{
+	return msecs_to_jiffies(delay_ms) <= timeout / 4;
+}
+
+/*
+ * 推迟delay_ms后再完成命令, 返回false时调用者照常完成.
+ * 延迟不能接近请求超时, 否则超时和错误处理先结束了命令, 
+ * 定时器再完成的就是已经释放或重用的请求
+ */
+bool scsi_swap_sim_delay(struct scsi_swap_sim *sim, struct scsi_cmnd *scmd, u32 delay_ms)
+{
+	struct sim_delay *delay;
+	unsigned long expires = msecs_to_jiffies(delay_ms);
+	unsigned long flags;
+
+	// 单条命令的超时可以比队列的短(SG_IO), 这时不推迟, 记一下
+	if (!scsi_swap_sim_delay_ok(scmd->request->timeout, delay_ms)) {
+		atomic_inc(&sim->delay_skipped);
+		if (printk_ratelimit())
+			SWAP_ERR("skip delay %ums, request timeout %ums\n", delay_ms, 
+					jiffies_to_msecs(scmd->request->timeout));
+		return false;
+	}
+
+	// 中断上下文, 分配失败时不推迟
+	delay = kmalloc(sizeof(*delay), GFP_ATOMIC);
+	if (!delay)
+		return false;
+
+	delay->sim = sim;
+	delay->scmd = scmd;
+	INIT_LIST_HEAD(&delay->entry);
+	setup_timer(&delay->timer, sim_delay_done, (unsigned long)delay);
+
+	spin_lock_irqsave(&sim->delay_lock, flags);
+	if (sim->dying) {
+		spin_unlock_irqrestore(&sim->delay_lock, flags);
+		kfree(delay);
+		return false;
+	}
+	list_add_tail(&delay->entry, &sim->delay_list);
+	mod_timer(&delay->timer, jiffies + expires);
+	spin_unlock_irqrestore(&sim->delay_lock, flags);
+
+	return true;
+}
+
+// 取消还没到时间的定时器, 马上完成这些命令
+static void sim_delay_flush(struct scsi_swap_sim *sim)
+{
+	struct sim_delay *delay;
+
+	spin_lock_irq(&sim->delay_lock);
+	sim->dying = true;
+	spin_unlock_irq(&sim->delay_lock);
+
+	for (;;) {
+		delay = NULL;
+		spin_lock_irq(&sim->delay_lock);
+		if (!list_empty(&sim->delay_list)) {
+			delay = list_first_entry(&sim->delay_list, struct sim_delay, entry);
+			list_del_init(&delay->entry);
+		}
+		spin_unlock_irq(&sim->delay_lock);
+
+		if (!delay)
+			break;
+
+		// 正在执行的sim_delay_done看到entry已经摘下, 直接返回
+		del_timer_sync(&delay->timer);
+		sim_delay_complete(delay->scmd);
+		kfree(delay);
+	}
+}
+
 int scsi_swap_sim_destroy(struct scsi_swap_sim *sim)
 {
-	struct sim_node *node, *tmp;
+	struct sim_table *table[2];
+	int rw;
 
-	spin_lock(&sim->list_lock);
-	list_for_each_entry_safe(node, tmp, &sim->list, entry) {
-		list_del(&node->entry);
-		kfree(node);
+	sim_delay_flush(sim);
+
+	mutex_lock(&sim->lock);
+	if (sim->active) {
+		sim->active = false;
+		static_key_slow_dec(&scsi_swap_sim_key);
+	}
+	for (rw = SIM_READ; rw <= SIM_WRITE; rw++) {
+		table[rw] = rcu_dereference_protected(sim->table[rw], 
+				lockdep_is_held(&sim->lock));
+		RCU_INIT_POINTER(sim->table[rw], NULL);
 	}
-	spin_unlock(&sim->list_lock);
+	mutex_unlock(&sim->lock);
+
+	synchronize_rcu();
+	sim_table_free(table[SIM_READ]);
+	sim_table_free(table[SIM_WRITE]);
+	// 等call_rcu挂出去的旧表都释放完
+	rcu_barrier();
+	flush_work(&sim->free_work);
+	mutex_destroy(&sim->lock);
 
 	return 0;
 }
 
-int scsi_swap_sim_add(struct scsi_swap_sim *sim, sector_t sector, int num)
+int scsi_swap_sim_add(struct scsi_swap_sim *sim, int rw, sector_t sector, int num, 
+		u32 percent, u32 delay_ms)
 {
-	struct sim_node *node;
+	struct sim_table *old;
+	struct sim_table *table;
+	int i;
 
-	node = kmalloc(sizeof(*node), GFP_KERNEL);
-	if (!node)
+	if (num <= 0 || percent > 100)
 		return -1;
 
-	node->start = sector;
-	node->num = num;
-	
-	spin_lock(&sim->list_lock);
-	list_add_tail(&node->entry, &sim->list);
-	spin_unlock(&sim->list_lock);
+	mutex_lock(&sim->lock);
+	old = rcu_dereference_protected(sim->table[rw], lockdep_is_held(&sim->lock));
+
+	table = sim_table_alloc(old->num + 1);
+	if (!table) {
+		mutex_unlock(&sim->lock);
+		return -1;
+	}
+
+	// 按起始扇区插入, 起始相同的排在后面
+	for (i = 0; i < old->num && old->ranges[i].start <= sector; i++)
+		;
+	memcpy(table->ranges, old->ranges, i * sizeof(struct sim_range));
+	memcpy(table->ranges + i + 1, old->ranges + i,
+			(old->num - i) * sizeof(struct sim_range));
+	table->ranges[i].start = sector;
+	table->ranges[i].end = sector + num - 1;
+	table->ranges[i].num = num;
+	table->ranges[i].percent = percent;
+	table->ranges[i].delay_ms = delay_ms;
+
+	sim_table_replace(sim, rw, table);
+	mutex_unlock(&sim->lock);
 
 	return 0;
 }
 
+// 读写两个表里起始扇区为sector的区间都删掉
 int scsi_swap_sim_remove(struct scsi_swap_sim *sim, sector_t sector, int num)
 {
-	struct sim_node *node, *tmp;
+	struct sim_table *old;
+	struct sim_table *table;
+	int ret = 0;
+	int rw;
+	int i;
 
-	spin_lock(&sim->list_lock);
-	list_for_each_entry_safe(node, tmp, &sim->list, entry) {
-		if (node->start == sector) {
-			list_del(&node->entry);
-			kfree(node);
-			break;
+	mutex_lock(&sim->lock);
+	for (rw = SIM_READ; rw <= SIM_WRITE; rw++) {
+		old = rcu_dereference_protected(sim->table[rw], lockdep_is_held(&sim->lock));
+
+		for (i = 0; i < old->num; i++) {
+			if (old->ranges[i].start == sector)
+				break;
 		}
+
+		if (i == old->num)
+			continue;
+
+		table = sim_table_alloc(old->num - 1);
+		if (!table) {
+			ret = -1;
+			continue;
+		}
+
+		memcpy(table->ranges, old->ranges, i * sizeof(struct sim_range));
+		memcpy(table->ranges + i, old->ranges + i + 1,
+				(old->num - i - 1) * sizeof(struct sim_range));
+
+		sim_table_replace(sim, rw, table);
 	}
-	spin_unlock(&sim->list_lock);
+	mutex_unlock(&sim->lock);
 
-	return 0;
+	return ret;
 }
 
-// FIXME: use hash table to make it more effective
-bool scsi_swap_sim_hit(struct scsi_swap_sim *sim, sector_t sector, int num)
+/*
+ * [sector, sector+num-1]和某个区间重叠: 起始扇区不大于sector+num-1的区间里
+ * 有end不小于sector的. 先二分找到这些区间的个数n, max_end[n-1]不小于sector
+ * 时命中; max_end单调不减, 再二分找第一个max_end不小于sector的区间,
+ * 它就是起始最小的重叠区间, 按它的概率和延迟处理.
+ * 中断上下文调用, O(log n), 不加锁
+ */
+bool scsi_swap_sim_hit(struct scsi_swap_sim *sim, int rw, sector_t sector, int num, 
+		struct sim_fault *fault)
 {
-	struct sim_node *node;
-	int ret = false;
+	struct sim_table *table;
+	struct sim_range *range;
+	sector_t end = sector + num - 1;
+	bool ret = false;
+	int lo = 0;
+	int hi;
+	int mid;
 
-	spin_lock(&sim->list_lock);
-	list_for_each_entry(node, &sim->list, entry) {
-		if (sectorA_hit_sectorB(sector, sector+num-1, 
-					node->start, node->start+node->num-1)) {
-			ret = true;
-			break;
-		}
+	rcu_read_lock();
+	table = rcu_dereference(sim->table[rw]);
+	hi = table ? table->num : 0;
+
+	// 第一个start > end的下标
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (table->ranges[mid].start <= end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0 || table->ranges[lo-1].max_end < sector)
+		goto out;
+
+	// 第一个max_end >= sector的下标
+	hi = lo - 1;
+	lo = 0;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (table->ranges[mid].max_end >= sector)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
-	spin_unlock(&sim->list_lock);
 
+	range = &table->ranges[lo];
+	fault->sector = max(sector, range->start);
+	fault->fail = range->percent >= 100 || 
+		(range->percent > 0 && prandom_u32() % 100 < range->percent);
+	fault->delay_ms = range->delay_ms;
+	ret = true;
+
+out:
+	rcu_read_unlock();
 	return ret;
 }
 
+// 每行: 起始扇区 扇区数 r/w 失败概率 延迟ms, 和add的格式一样
 int scsi_swap_sim_show(struct scsi_swap_sim *sim, char *page)
 {
-	struct sim_node *node;
-	char buf[64];
+	struct sim_table *table;
+	struct sim_range *range;
+	char buf[96];
 	int len;
 	int left = PAGE_SIZE;
+	int rw;
+	int i;
 
-	spin_lock(&sim->list_lock);
-	list_for_each_entry(node, &sim->list, entry) {
-		len = snprintf(buf, sizeof(buf), "%llu %u\n", 
-				(unsigned long long)node->start, node->num);
-		if (left <= len)
-			break;
-		strcpy(page+(PAGE_SIZE-left), buf);
-		left -= len;
+	rcu_read_lock();
+	for (rw = SIM_READ; rw <= SIM_WRITE; rw++) {
+		table = rcu_dereference(sim->table[rw]);
+		for (i = 0; i < table->num; i++) {
+			range = &table->ranges[i];
+			len = snprintf(buf, sizeof(buf), "%llu %u %s %u %u\n",
+					(unsigned long long)range->start, range->num, 
+					rw == SIM_READ ? "r" : "w", 
+					range->percent, range->delay_ms);
+			if (left <= len)
+				goto out;
+			strcpy(page+(PAGE_SIZE-left), buf);
+			left -= len;
+		}
 	}
-	spin_unlock(&sim->list_lock);
+	rcu_read_unlock();
 
+	if (atomic_read(&sim->delay_skipped)) {
+		len = snprintf(buf, sizeof(buf), "delay_skipped %d\n", 
+				atomic_read(&sim->delay_skipped));
+		if (left > len) {
+			strcpy(page+(PAGE_SIZE-left), buf);
+			left -= len;
+		}
+	}
 	return PAGE_SIZE-left;
-}
 
+out:
+	rcu_read_unlock();
+
+	return PAGE_SIZE-left;
+}
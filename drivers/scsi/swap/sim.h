@@ -13,18 +13,53 @@
 #define _SCSI_SWAP_SIMULATE_H
 
 #include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
 
+struct sim_table;
+struct scsi_cmnd;
+
+/* 模拟的方向, 下标 */
+#define SIM_READ	0
+#define SIM_WRITE	1
+
+/* 
+ * 模拟的坏扇区按起始扇区排好序放在数组里, 读写各一个, 
+ * scsi_done里在RCU下二分查找, 不加锁; 增删时复制一份新数组替换
+ */
 struct scsi_swap_sim {
-	struct list_head list;
-	spinlock_t list_lock;
+	struct sim_table __rcu *table[2];
+	struct mutex lock;		/* 写者互斥 */
+	bool active;			/* 有区间, 占着scsi_swap_sim_key的一个计数 */
+	struct list_head delay_list;	/* 推迟完成的命令, 销毁时取消定时器并完成 */
+	spinlock_t delay_lock;		/* scsi_done在中断上下文, 用irq锁 */
+	bool dying;			/* 销毁中, 不再推迟 */
+	struct list_head free_list;	/* 过了宽限期等vfree的旧表 */
+	spinlock_t free_lock;		/* RCU回调在软中断, 用bh锁 */
+	struct work_struct free_work;
+	atomic_t delay_skipped;		/* 超过延迟上限没有推迟的命令数 */
+};
+
+/* 命中的区间对这条命令的处理 */
+struct sim_fault {
+	sector_t sector;		/* 第一个坏扇区 */
+	bool fail;			/* 按概率决定这次是否失败 */
+	u32 delay_ms;			/* 推迟完成的时间 */
 };
 
 int scsi_swap_sim_init(struct scsi_swap_sim *sim);
 int scsi_swap_sim_destroy(struct scsi_swap_sim *sim);
-int scsi_swap_sim_add(struct scsi_swap_sim *sim, sector_t sector, int num);
+int scsi_swap_sim_add(struct scsi_swap_sim *sim, int rw, sector_t sector, int num, 
+		u32 percent, u32 delay_ms);
 int scsi_swap_sim_remove(struct scsi_swap_sim *sim, sector_t sector, int num);
-bool scsi_swap_sim_hit(struct scsi_swap_sim *sim, sector_t sector, int num);
+bool scsi_swap_sim_hit(struct scsi_swap_sim *sim, int rw, sector_t sector, int num, 
+		struct sim_fault *fault);
+bool scsi_swap_sim_delay_ok(unsigned int timeout, u32 delay_ms);
+bool scsi_swap_sim_delay(struct scsi_swap_sim *sim, struct scsi_cmnd *scmd, u32 delay_ms);
 int scsi_swap_sim_show(struct scsi_swap_sim *sim, char *page);
 
 #endif
@@ -0,0 +1,101 @@
+/*
+ * =================================================================================
+ *   (c) Copyright 1992-2013, mincore@163.com
+ *                            All Rights Reserved
+ *       Filename: stats.c
+ *    Description: 每个盘的映射IO计数和延迟分布
+ *        Created: 2013年12月10日 10时15分02秒
+ *         Author: csp
+ *         Modify:  
+ * =================================================================================
+ */
+#include <linux/kernel.h>
+#include <linux/cpumask.h>
+#include <linux/slab.h>
+
+#include "swap.h"
+
+static const char *swap_stat_names[SWAP_STAT_NR] = {
+	[SWAP_STAT_CHECK_HIT]	= "check_hits",
+	[SWAP_STAT_CHECK_MISS]	= "check_misses",
+	[SWAP_STAT_READ]	= "reads",
+	[SWAP_STAT_WRITE]	= "writes",
+	[SWAP_STAT_READ_SECTORS]	= "read_sectors",
+	[SWAP_STAT_WRITE_SECTORS]	= "write_sectors",
+	[SWAP_STAT_RAM_BYTES]	= "ram_bytes",
+	[SWAP_STAT_POOL_BYTES]	= "pool_bytes",
+	[SWAP_STAT_CREATE]	= "creates",
+	[SWAP_STAT_CREATE_FAIL]	= "create_failures",
+	[SWAP_STAT_TABLE_FLUSH]	= "table_flushes",
+	[SWAP_STAT_HEAD_FLUSH]	= "head_flushes",
+	[SWAP_STAT_LOG_FLUSH]	= "log_flushes",
+};
+
+static const char *swap_lat_names[SWAP_LAT_NR] = {
+	[SWAP_LAT_QUEUE]	= "queue_lat_us",
+	[SWAP_LAT_READ]		= "read_lat_us",
+	[SWAP_LAT_WRITE]	= "write_lat_us",
+	[SWAP_LAT_TABLE_FLUSH]	= "table_flush_lat_us",
+	[SWAP_LAT_HEAD_FLUSH]	= "head_flush_lat_us",
+	[SWAP_LAT_LOG_FLUSH]	= "log_flush_lat_us",
+};
+
+int scsi_swap_stats_init(struct scsi_swap_stats *stats)
+{
+	stats->cpu = alloc_percpu(struct swap_stats_cpu);
+	if (stats->cpu == NULL) {
+		SWAP_ERR("alloc swap stats failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int scsi_swap_stats_destroy(struct scsi_swap_stats *stats)
+{
+	free_percpu(stats->cpu);
+	stats->cpu = NULL;
+	return 0;
+}
+
+/* 
+ * 先打印计数, 每行"名字 值"; 再打印延迟分布, 每行一个名字后面
+ * SWAP_LAT_BUCKETS个桶, 第i个桶是[2^(i-1), 2^i)us
+ */
+int scsi_swap_stats_show(struct scsi_swap_stats *stats, char *page)
+{
+	struct swap_stats_cpu *sum;
+	struct swap_stats_cpu *pcpu;
+	int len = 0;
+	int cpu;
+	int i;
+	int j;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (sum == NULL)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(stats->cpu, cpu);
+		for (i = 0; i < SWAP_STAT_NR; i++)
+			sum->count[i] += pcpu->count[i];
+		for (i = 0; i < SWAP_LAT_NR; i++)
+			for (j = 0; j < SWAP_LAT_BUCKETS; j++)
+				sum->lat[i][j] += pcpu->lat[i][j];
+	}
+
+	for (i = 0; i < SWAP_STAT_NR; i++)
+		len += scnprintf(page + len, PAGE_SIZE - len, "%s %llu\n", 
+				swap_stat_names[i], (unsigned long long)sum->count[i]);
+
+	for (i = 0; i < SWAP_LAT_NR; i++) {
+		len += scnprintf(page + len, PAGE_SIZE - len, "%s", swap_lat_names[i]);
+		for (j = 0; j < SWAP_LAT_BUCKETS; j++)
+			len += scnprintf(page + len, PAGE_SIZE - len, " %llu", 
+					(unsigned long long)sum->lat[i][j]);
+		len += scnprintf(page + len, PAGE_SIZE - len, "\n");
+	}
+
+	kfree(sum);
+	return len;
+}
@@ -0,0 +1,83 @@
+/*
+ * =====================================================================================
+ *   (c) Copyright 1992-2013, mincore@163.com
+ *                            All Rights Reserved
+ *       Filename: stats.h
+ *    Description: 每个盘的映射IO计数和延迟分布
+ *        Created: 2013年12月10日 10时12分36秒
+ *         Author: csp
+ *         Modify:  
+ * =====================================================================================
+ */
+#ifndef _SCSI_SWAP_STATS_H
+#define _SCSI_SWAP_STATS_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+
+enum swap_stat_counter {
+	SWAP_STAT_CHECK_HIT,		/* bio_has_bad_block()命中映射块 */
+	SWAP_STAT_CHECK_MISS,
+	SWAP_STAT_READ,			/* swap_bio执行的读 */
+	SWAP_STAT_WRITE,
+	SWAP_STAT_READ_SECTORS,
+	SWAP_STAT_WRITE_SECTORS,
+	SWAP_STAT_RAM_BYTES,		/* 从映射块缓存读的字节 */
+	SWAP_STAT_POOL_BYTES,		/* 读写映射区的字节, 写总是落到映射区 */
+	SWAP_STAT_CREATE,		/* 新建映射 */
+	SWAP_STAT_CREATE_FAIL,
+	SWAP_STAT_TABLE_FLUSH,		/* swap_table_commit */
+	SWAP_STAT_HEAD_FLUSH,		/* flush_swap_head */
+	SWAP_STAT_LOG_FLUSH,		/* log后台写 */
+	SWAP_STAT_NR,
+};
+
+enum swap_stat_latency {
+	SWAP_LAT_QUEUE,			/* swap_bio入队到开始执行 */
+	SWAP_LAT_READ,			/* scsi_swap_core_read */
+	SWAP_LAT_WRITE,			/* scsi_swap_core_write */
+	SWAP_LAT_TABLE_FLUSH,
+	SWAP_LAT_HEAD_FLUSH,
+	SWAP_LAT_LOG_FLUSH,
+	SWAP_LAT_NR,
+};
+
+/* 按us取log2分桶: 0桶小于1us, 第i桶[2^(i-1), 2^i)us, 最后一桶包括更慢的 */
+#define SWAP_LAT_BUCKETS	24
+
+struct swap_stats_cpu {
+	u64 count[SWAP_STAT_NR];
+	u64 lat[SWAP_LAT_NR][SWAP_LAT_BUCKETS];
+};
+
+/* 每CPU一份, 更新不加锁, 读时求和 */
+struct scsi_swap_stats {
+	struct swap_stats_cpu __percpu *cpu;
+};
+
+static inline void swap_stat_add(struct scsi_swap_stats *stats, int item, u64 val)
+{
+	this_cpu_add(stats->cpu->count[item], val);
+}
+
+static inline void swap_stat_inc(struct scsi_swap_stats *stats, int item)
+{
+	this_cpu_inc(stats->cpu->count[item]);
+}
+
+/* 记录从start到现在的延迟 */
+static inline void swap_stat_latency(struct scsi_swap_stats *stats, int item, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = us > 0 ? min_t(int, fls64(us), SWAP_LAT_BUCKETS - 1) : 0;
+
+	this_cpu_inc(stats->cpu->lat[item][bucket]);
+}
+
+int scsi_swap_stats_init(struct scsi_swap_stats *stats);
+int scsi_swap_stats_destroy(struct scsi_swap_stats *stats);
+int scsi_swap_stats_show(struct scsi_swap_stats *stats, char *page);
+
+#endif
@@ -10,6 +10,8 @@
  * =================================================================================
  */
 #include <linux/bio.h>
+#include <linux/ktime.h>
+#include <linux/genhd.h>
 #include <scsi/scsi_device.h>
 #include <scsi/scsi_host.h>
 #include <scsi/scsi_cmnd.h>
@@ -19,6 +21,15 @@
 #include "sysfs.h"
 #include "utils.h"
 
+#ifdef CONFIG_SCSI_SIM_BADSECTORS
+#include <linux/log2.h>
+#include <asm/unaligned.h>
+#include <scsi/scsi_eh.h>
+#endif
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/scsi_swap.h>
+
 struct swap_bio_item{
     struct work_struct work;
 	struct scsi_swap *swap; struct bio *bio;
@@ -26,6 +37,23 @@ struct swap_bio_item{
     int size;
     sector_t bad_sec;
     bool may_create;
+    ktime_t queued;
+    struct hd_struct *part;     /* 记diskstats的分区 */
+    unsigned long start_time;   /* jiffies, diskstats的ticks */
+};
+
+/* 每个盘预留的swap_bio_item和swap_split个数, 内存紧张时映射IO仍能前进 */
+#define SWAP_POOL_MIN       16
+
+/* 一个bio最多拆成的段数, 更多时整个bio走swap_bio */
+#define SWAP_SPLIT_MAX      16
+
+/* 部分映射的bio拆分后, 所有子bio完成时结束原bio */
+struct swap_split{
+    struct scsi_swap *swap;
+    struct bio *parent;
+    atomic_t remaining;
+    int error;
 };
 
 struct swap_bio_private{
@@ -33,7 +61,8 @@ struct swap_bio_private{
     bio_end_io_t *orgi_bi_end_io;
 };
 
-static struct workqueue_struct *g_swap_wq = NULL;	
+/* 任意一个硬盘有映射时打开, 见bio_has_bad_block() */
+struct static_key scsi_swap_remap_key = STATIC_KEY_INIT_FALSE;
 
 static struct scsi_device *sdev_from_bdev(struct block_device *bdev)
 {
@@ -57,6 +86,10 @@ static struct scsi_device *sdev_from_bdev(struct block_device *bdev)
     return to_scsi_device(sdev_gendev);
 }
 
+/* 
+ * 调用者持rcu_read_lock, 到不再用handler为止. 
+ * scsi_swap_destroy清enable后synchronize_rcu, 之后不会再有人拿到handler
+ */
 static struct scsi_swap *bio_get_scsi_swap(struct bio *bio)
 {
     struct scsi_device *sdev;
@@ -77,58 +110,42 @@ static struct scsi_swap *bio_get_scsi_swap(struct bio *bio)
 }
 
 
-static void buf_fill_bio(struct bio *bio, char *buf, int len)
+/*
+ * 映射IO在工作队列里完成, 不经过请求队列的统计, 在这里记到盘的diskstats.
+ * generic_make_request直接转来的bio没有统计过, 记ios和扇区;
+ * 请求出错后转来的bio, 请求已经记过ios和扇区, 只补上映射花的时间.
+ * 请求出错时bio已经映射到整盘, 要记到请求的分区上, 由调用者传入
+ */
+static void swap_account_start(struct swap_bio_item *item)
 {
-    struct bio_vec *bvec;
-    char *p = buf;
-    char *addr= NULL;
-    int i;
+    int rw = bio_data_dir(item->bio);
+    int cpu;
 
-    bio_for_each_segment(bvec, bio, i) {
-        if(p < buf+len){
-            addr = page_address(bvec->bv_page);
-            if(addr)
-                memcpy(addr + bvec->bv_offset, p, bvec->bv_len);
-            else {
-                addr = kmap_atomic(bvec->bv_page);
-                if (addr) {
-                    memcpy(addr + bvec->bv_offset, p, bvec->bv_len);
-                    kunmap_atomic(addr);
-                }
-                else
-                    SWAP_DEBUG("error: NULL page addr, will lost data on sector(%llu: %d) read\n", 
-							(unsigned long long)bio->bi_sector, (bio->bi_size >> 9));
-            }
-            p += bvec->bv_len;
-        }
+    hd_struct_get(item->part);
+    item->start_time = jiffies;
+
+    cpu = part_stat_lock();
+    part_round_stats(cpu, item->part);
+    if (!item->may_create)
+    {
+        part_stat_inc(cpu, item->part, ios[rw]);
+        part_stat_add(cpu, item->part, sectors[rw], item->size >> 9);
     }
+    part_inc_in_flight(item->part, rw);
+    part_stat_unlock();
 }
 
-static void bio_fill_buf(struct bio *bio, char *buf, int len)
+static void swap_account_done(struct swap_bio_item *item)
 {
-    struct bio_vec *bvec;
-    char *p = buf;
-    char *addr = NULL;
-    int i;
-
-    bio_for_each_segment(bvec, bio, i) {
-        if(p < buf+len){
-            addr = page_address(bvec->bv_page);
-            if(addr)
-                memcpy(p, addr + bvec->bv_offset, bvec->bv_len);
-            else {
-                addr = kmap_atomic(bvec->bv_page);
-                if (addr) {
-                    memcpy(p, addr + bvec->bv_offset, bvec->bv_len);
-                    kunmap_atomic(addr);
-                }
-                else
-                    SWAP_DEBUG("error: NULL page addr, will lost data on sector(%llu: %d) write\n", 
-							(unsigned long long)bio->bi_sector, (bio->bi_size >> 9));
-            }
-            p += bvec->bv_len;
-        }
-    }
+    int rw = bio_data_dir(item->bio);
+    int cpu;
+
+    cpu = part_stat_lock();
+    part_stat_add(cpu, item->part, ticks[rw], jiffies - item->start_time);
+    part_round_stats(cpu, item->part);
+    part_dec_in_flight(item->part, rw);
+    part_stat_unlock();
+    hd_struct_put(item->part);
 }
 
 static void swap_bio_work_handler(struct work_struct *work)
@@ -137,7 +154,7 @@ static void swap_bio_work_handler(struct work_struct *work)
 	struct scsi_swap *swap = item->swap;
     struct bio *bio = item->bio;
     int rw = bio->bi_rw & WRITE;
-    char *buf = NULL;
+    struct swap_sg sg;
     sector_t sector;
     sector_t bad;
     int size;
@@ -145,81 +162,98 @@ static void swap_bio_work_handler(struct work_struct *work)
     int done = 0;
     int ret = 0;
 	int num;
+	u64 latency;
 	struct scsi_swap_core *core = swap_to_swap_core(swap);
+	struct swap_queue_stat *stat = swap_to_swap_queue(swap);
+	struct scsi_swap_stats *stats = swap_to_swap_stats(swap);
+	ktime_t start;
 
     sector = item->start_sec;
     size = item->size;
     bad = item->bad_sec;
 	num = size >> 9;
 
-    buf = kmalloc(size, GFP_KERNEL);
+    /* 直接读写bio的页面, 不再分配整个bio大小的缓冲 */
+    swap_sg_init(&sg, bio);
+
+    start = ktime_get();
+    swap_stat_latency(stats, SWAP_LAT_QUEUE, item->queued);
+    trace_scsi_swap_bio_start(swap_devt(swap), rw, sector, num, item->queued);
 
-    if (NULL == buf)
+    if(rw == WRITE)
     {
-        SWAP_ERR("kmalloc buf fail\n");
-        goto out;
+        //SWAP_INFO("core_write size = %d\n", size);
+        ret = scsi_swap_core_write(core, sector, num, bad, &sg);
+        swap_stat_inc(stats, SWAP_STAT_WRITE);
+        swap_stat_add(stats, SWAP_STAT_WRITE_SECTORS, num);
+        swap_stat_latency(stats, SWAP_LAT_WRITE, start);
     }
     else
     {
-        if(rw == WRITE)
-        {
-            bio_fill_buf(bio, buf, size);
-            //SWAP_INFO("core_write size = %d\n", size);
-            ret = scsi_swap_core_write(core, sector, num, bad, buf, size);
-            if(0 == ret)
-            {
-                done = 1;
-            }
-            else if (-DATA_MAY_DIRTY == ret)
-            {
-                //set_bit(BIO_RAID_REREAD, &bio->bi_flags);
-                done = 1;
-            }
-        }
-        else
-        {
-            //SWAP_INFO("core_read, size = %d\n", size);
-            ret = scsi_swap_core_read(core, sector, num, bad, buf, size);
-            if(0 == ret)
-            {
-                done = 1;
-                buf_fill_bio(bio, buf, size);
-            }
-            else if (-DATA_MAY_DIRTY == ret)
-            {
-                //set_bit(BIO_RAID_REREAD, &bio->bi_flags);
-                done = 1;
-                buf_fill_bio(bio, buf, size);
-            }
-        }
+        //SWAP_INFO("core_read, size = %d\n", size);
+        ret = scsi_swap_core_read(core, sector, num, bad, &sg);
+        swap_stat_inc(stats, SWAP_STAT_READ);
+        swap_stat_add(stats, SWAP_STAT_READ_SECTORS, num);
+        swap_stat_latency(stats, SWAP_LAT_READ, start);
+    }
 
-        SWAP_DEBUG("%s sector:%llu, count:%u done:%d\n", rw == WRITE?"core_write":"core_read", 
-				(unsigned long long)sector, size>>9, done);
+    if(0 == ret)
+    {
+        done = 1;
+    }
+    else if (-DATA_MAY_DIRTY == ret)
+    {
+        //set_bit(BIO_RAID_REREAD, &bio->bi_flags);
+        done = 1;
+    }
 
-        if (done) 
-        {
-            set_bit(BIO_UPTODATE, &bio->bi_flags);
-            error = 0;
-        }
+    SWAP_DEBUG("%s sector:%llu, count:%u done:%d\n", rw == WRITE?"core_write":"core_read", 
+            (unsigned long long)sector, size>>9, done);
+    trace_scsi_swap_bio_done(swap_devt(swap), rw, sector, num, ret, start);
 
-        kfree(buf);
+    if (done) 
+    {
+        set_bit(BIO_UPTODATE, &bio->bi_flags);
+        error = 0;
     }
+
     if (bio->bi_size >= size)
     {
         bio->bi_size -= size;
         bio->bi_sector += (size >> 9);
     }
 
-out:
-    kfree(item);
+    /* 从入队到完成的时间, 包括在本盘队列里等待的时间 */
+    latency = ktime_us_delta(ktime_get(), item->queued);
+    stat->completed++;
+    stat->latency_us += latency;
+    if (latency > stat->max_latency_us)
+        stat->max_latency_us = latency;
+    atomic_dec(&stat->depth);
+    swap_account_done(item);
+
+    mempool_free(item, swap_to_swap_handler(swap)->item_pool);
     if (bio->bi_end_io)
         bio->bi_end_io(bio, error);
 
 }
 
+static void swap_load_work_handler(struct work_struct *work)
+{
+	struct swap_handler *handler = 
+		container_of(work, struct swap_handler, load_work);
+
+	/* 每次只读一批, 没读完就排到队尾, 先让排在后面的映射IO执行 */
+	if (scsi_swap_core_load(&handler->core) > 0 && handler->swap->enable)
+		queue_work(handler->wq, &handler->load_work);
+}
+
 static const char *swap_filter_table[] = {
 	"mv64xx",
 	"pm8001",
+#ifdef CONFIG_SCSI_SIM_BADSECTORS
+	"scsi_debug",	/* 用模拟器测试, 盘要大于保留的1G */
+#endif
 };
 
 static bool scsi_device_can_swap(struct scsi_device *sdp)
@@ -246,7 +280,8 @@ sector_t scsi_get_reserve_sectors_for_swap(struct scsi_device *sdp)
 	return scsi_device_can_swap(sdp) ? MAX_RESERVED_SECTOR : 0;
 }
 
-bool swap_bio(struct bio *bio, sector_t sector, int size, sector_t bad_sec, int error, int may_create)
+bool swap_bio(struct bio *bio, struct hd_struct *part, sector_t sector, int size, 
+		sector_t bad_sec, int error, int may_create)
 {
     struct swap_bio_item *item;
 	struct scsi_swap *swap;
@@ -260,19 +295,21 @@ bool swap_bio(struct bio *bio, sector_t sector, int size, sector_t bad_sec, int
             goto err;
         }
 		
+		rcu_read_lock();
 		swap = bio_get_scsi_swap(bio);
 		if (!swap)
-			goto err;
+			goto err_unlock;
 
 		core = swap_to_swap_core(swap);
 
 		if (!scsi_swap_core_can_swap(core, sector, size))
-			goto err;
+			goto err_unlock;
 
-        item = kmalloc(sizeof(struct swap_bio_item), GFP_ATOMIC);
+        /* 完成上下文里不能睡眠, 分配失败时用预留的item */
+        item = mempool_alloc(swap_to_swap_handler(swap)->item_pool, GFP_ATOMIC);
         if(!item){
-            SWAP_ERR("kmalloc size %lu failed\n", sizeof(struct swap_bio_item));
-            goto err;
+            SWAP_ERR("alloc swap_bio_item failed\n");
+            goto err_unlock;
         }
 
 		item->swap = swap;
@@ -281,34 +318,177 @@ bool swap_bio(struct bio *bio, sector_t sector, int size, sector_t bad_sec, int
         item->size = size;
 		item->bad_sec = bad_sec;
         item->may_create = may_create;
+        item->part = part ? part : bio->bi_bdev->bd_part;
 
         SWAP_DEBUG("start sector = %llu, size = %d, bad_sec = %llu, "
 				"error = %d, may_create = %d\n", 
 				(unsigned long long)sector, size>>9, 
 				(unsigned long long)bad_sec, error, may_create);
 
+        /* 每个盘一个有序队列, 一个盘超时不会阻塞其他盘的映射IO */
+        item->queued = ktime_get();
+        trace_scsi_swap_bio_queue(swap_devt(swap), rw, sector, size >> 9, bad_sec);
+        swap_account_start(item);
+        atomic_inc(&swap_to_swap_queue(swap)->depth);
         INIT_WORK(&item->work, swap_bio_work_handler);
-        queue_work(g_swap_wq, &item->work);
+        queue_work(swap_to_swap_handler(swap)->wq, &item->work);
+		rcu_read_unlock();
 
         return true;
     }
+	return false;
 
+err_unlock:
+	rcu_read_unlock();
 err:
     return false;
 }
 
-bool bio_has_bad_block (struct bio *bio)
+static void swap_split_endio(struct bio *bio, int error)
+{
+    struct swap_split *split = bio->bi_private;
+
+    if (!error && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+        error = -EIO;
+    if (error)
+        split->error = error;
+
+    bio_put(bio);
+
+    if (atomic_dec_and_test(&split->remaining)) {
+        struct swap_handler *handler = swap_to_swap_handler(split->swap);
+        struct bio *parent = split->parent;
+        int err = split->error;
+
+        mempool_free(split, handler->split_pool);
+        bio_endio(parent, err);
+
+        /* 子bio和split都已经还回池里, 销毁可以继续 */
+        if (atomic_dec_and_test(&handler->split_inflight))
+            wake_up(&handler->split_wait);
+    }
+}
+
+/* 从sector开始, 映射状态相同的连续扇区数 */
+static u32 swap_split_run(struct scsi_swap_core *core, sector_t sector, sector_t end)
+{
+    bool swapped = scsi_swap_core_swapped(core, sector, 1);
+    sector_t next = swap_next_blk(core, sector);
+
+    while (next < end && scsi_swap_core_swapped(core, next, 1) == swapped)
+        next = swap_next_blk(core, next);
+
+    return (u32)(min(next, end) - sector);
+}
+
+/*
+ * 按映射边界拆分bio: 没有映射的部分继续走正常的请求队列, 
+ * 只有映射块进入swap_bio. 整个bio都是映射块时返回false.
+ * 带FLUSH/FUA的bio不拆, 复制到每个子bio会重复刷盘, 整个走swap_bio.
+ */
+bool swap_split_bio(struct bio *bio)
 {
 	struct scsi_swap *swap;
 	struct scsi_swap_core *core;
-	
+    struct swap_split *split;
+    struct bio *children[SWAP_SPLIT_MAX];
+    struct swap_sg sg;
+    sector_t sector = bio->bi_sector;
+    sector_t end = bio->bi_sector + bio_sectors(bio);
+    u32 num;
+    int nr = 0;
+    int i;
+
+    if (bio->bi_rw & (REQ_FLUSH | REQ_FUA))
+        return false;
+
+	/* enable清掉以后不再拆分, scsi_swap_destroy在synchronize_rcu后等计数归0 */
+	rcu_read_lock();
 	swap = bio_get_scsi_swap(bio);
 	if (!swap)
+		goto out;
+
+	core = swap_to_swap_core(swap);
+
+    if (swap_split_run(core, sector, end) == bio_sectors(bio))
+        goto out;
+
+    /*
+     * 不能等待: 同一线程之前拆出的子bio还在current->bio_list上没有下发,
+     * 等待它们归还会死锁. split和子bio的预留用完时整个bio走swap_bio.
+     */
+    split = mempool_alloc(swap_to_swap_handler(swap)->split_pool, GFP_NOWAIT);
+    if (!split)
+        goto out;
+
+    /* 先把子bio都建好, 失败时整个bio还可以走原来的路径 */
+    swap_sg_init(&sg, bio);
+    while (sector < end) {
+        num = swap_split_run(core, sector, end);
+        if (nr == ARRAY_SIZE(children))
+            goto err;
+        children[nr] = swap_sg_bio(&sg, num << 9, bio->bi_rw, GFP_NOWAIT, 
+                swap_to_bio_set(swap));
+        if (!children[nr])
+            goto err;
+
+        children[nr]->bi_bdev = bio->bi_bdev;
+        children[nr]->bi_sector = sector;
+        children[nr]->bi_end_io = swap_split_endio;
+        children[nr]->bi_private = split;
+        nr++;
+
+        swap_sg_skip(&sg, num << 9);
+        sector += num;
+    }
+
+    SWAP_DEBUG("split sector %llu, count %u into %d bios\n", 
+            (unsigned long long)bio->bi_sector, bio_sectors(bio), nr);
+
+    split->swap = swap;
+    split->parent = bio;
+    split->error = 0;
+    atomic_set(&split->remaining, nr);
+    atomic_inc(&swap_to_swap_handler(swap)->split_inflight);
+	rcu_read_unlock();
+
+    for (i = 0; i < nr; i++)
+        generic_make_request(children[i]);
+
+    return true;
+
+err:
+    while (nr-- > 0)
+        bio_put(children[nr]);
+    mempool_free(split, swap_to_swap_handler(swap)->split_pool);
+out:
+	rcu_read_unlock();
+    return false;
+}
+
+bool __bio_has_bad_block(struct bio *bio)
+{
+	struct scsi_swap *swap;
+	struct scsi_swap_core *core;
+	bool swapped;
+	
+	rcu_read_lock();
+	swap = bio_get_scsi_swap(bio);
+	if (!swap) {
+		rcu_read_unlock();
 		return false;
+	}
 
 	core = swap_to_swap_core(swap);
     
-	return scsi_swap_core_swapped(core, bio->bi_sector, bio_sectors(bio));
+	swapped = scsi_swap_core_swapped(core, bio->bi_sector, bio_sectors(bio));
+	swap_stat_inc(swap_to_swap_stats(swap), 
+			swapped ? SWAP_STAT_CHECK_HIT : SWAP_STAT_CHECK_MISS);
+	if (swapped)
+		trace_scsi_swap_bio_check(swap_devt(swap), bio->bi_sector, bio_sectors(bio));
+	rcu_read_unlock();
+
+	return swapped;
 }
 
 #ifdef CONFIG_SCSI_SIM_BADSECTORS
@@ -397,24 +577,84 @@ static int scmd_get_action(struct scsi_cmnd *scmd)
 	return SCSI_ACTION_UNKNOWN;
 }
 
-bool scmd_should_be_bad(struct scsi_cmnd *scmd)
+/* 任意一个硬盘有模拟的区间时打开, 见scmd_simulate_done() */
+struct static_key scsi_swap_sim_key = STATIC_KEY_INIT_FALSE;
+
+// 读出错: unrecovered read error, information字段是第一个坏的LBA, sd按它算完成的字节
+static void scmd_set_medium_error(struct scsi_cmnd *scmd, sector_t lba)
+{
+	u8 *sense = scmd->sense_buffer;
+
+	// 固定格式的INFORMATION只有32位, 放不下时用描述符格式带64位的information描述符
+	if (lba <= 0xffffffff) {
+		scsi_build_sense_buffer(0, sense, MEDIUM_ERROR, 0x11, 0);
+		sense[0] |= 0x80;
+		put_unaligned_be32((u32)lba, &sense[3]);
+	} else {
+		scsi_build_sense_buffer(1, sense, MEDIUM_ERROR, 0x11, 0);
+		sense[7] = 12;
+		sense[8] = 0x00;
+		sense[9] = 0x0a;
+		sense[10] = 0x80;
+		put_unaligned_be64((u64)lba, &sense[12]);
+	}
+	scmd->result = (DRIVER_SENSE << 24) | SAM_STAT_CHECK_CONDITION;
+}
+
+/*
+ * scsi_done里调用, 命中模拟的坏扇区时按区间的概率改写结果: 
+ * 写失败和以前一样, 读失败返回medium error. 
+ * 区间有延迟时返回true, 由定时器完成命令
+ */
+static bool scmd_simulate_fault(struct scsi_cmnd *scmd)
 {
 	struct scsi_swap_sim *sim;
+	struct sim_fault fault;
 	sector_t sector;
 	u32 num;
+	int action;
+	int shift;
 
-	// read int in x86 is atomic
-	if (!scmd->device->swap.enable)
+	action = scmd_get_action(scmd);
+	if (action == SCSI_ACTION_UNKNOWN)
 		return false;
 
-	// only write operation can be simulated
-	if (scmd_get_action(scmd) != SCSI_ACTION_WRITE)
+	num = sector_from_scmd(scmd, &sector);
+	if (num == 0)
 		return false;
 
-	num = sector_from_scmd(scmd, &sector);
+	// 命令里是逻辑块, 模拟的区间是512字节扇区
+	shift = ilog2(max(scmd->device->sector_size, (unsigned)SECTOR_SIZE)) - 9;
 	sim = swap_to_swap_sim(&scmd->device->swap);
 
-	return scsi_swap_sim_hit(sim, sector, num);
+	if (!scsi_swap_sim_hit(sim, action == SCSI_ACTION_READ ? SIM_READ : SIM_WRITE, 
+				sector << shift, num << shift, &fault))
+		return false;
+
+	if (fault.fail) {
+		if (action == SCSI_ACTION_READ)
+			scmd_set_medium_error(scmd, fault.sector >> shift);
+		else
+			scmd->result |= (DRIVER_INVALID << 24 | DID_ABORT << 16);
+	}
+
+	if (fault.delay_ms == 0)
+		return false;
+
+	return scsi_swap_sim_delay(sim, scmd, fault.delay_ms);
+}
+
+bool __scmd_simulate_done(struct scsi_cmnd *scmd)
+{
+	bool ret = false;
+
+	// 和bio_get_scsi_swap一样, 在RCU下检查enable并使用sim
+	rcu_read_lock();
+	if (scmd->device->swap.enable)
+		ret = scmd_simulate_fault(scmd);
+	rcu_read_unlock();
+
+	return ret;
 }
 #endif
 
@@ -433,26 +673,79 @@ int scsi_swap_init(struct scsi_swap *swap, struct gendisk *gd, sector_t reserve_
 
 	handler->swap = swap;
 	swap->private_data = handler;
-	
-	if (scsi_swap_core_init(&handler->core, reserve_sector) < 0) {
-		kfree(handler);
-		return -1;
+
+	handler->item_pool = mempool_create_kmalloc_pool(SWAP_POOL_MIN, 
+			sizeof(struct swap_bio_item));
+	if (!handler->item_pool)
+		goto err_free;
+
+	handler->split_pool = mempool_create_kmalloc_pool(SWAP_POOL_MIN, 
+			sizeof(struct swap_split));
+	if (!handler->split_pool)
+		goto err_item_pool;
+	atomic_set(&handler->split_inflight, 0);
+	init_waitqueue_head(&handler->split_wait);
+
+	handler->bio_set = bioset_create(SWAP_POOL_MIN, 0);
+	if (!handler->bio_set)
+		goto err_split_pool;
+
+	/* swap_bio在IO路径上, 需要WQ_MEM_RECLAIM保证内存紧张时也能前进 */
+	handler->wq = alloc_ordered_workqueue("blkswap/%s", WQ_MEM_RECLAIM, 
+			gd->disk_name);
+	if (!handler->wq) {
+		SWAP_ERR("create blkswap/%s workqueue fail\n", gd->disk_name);
+		goto err_bio_set;
 	}
+
+	/* 加载映射表时就会计数, 在core之前初始化 */
+	if (scsi_swap_stats_init(&handler->stats) < 0)
+		goto err_wq;
+	
+	if (scsi_swap_core_init(&handler->core, reserve_sector) < 0)
+		goto err_stats;
 	
 	scsi_swap_log_init(&handler->log, 
 			reserve_sector + SWAP_LOG_HEAD_OFFSET, 
 			reserve_sector + SWAP_LOG_DATA_OFFSET);
 
 #ifdef CONFIG_SCSI_SIM_BADSECTORS
-	scsi_swap_sim_init(&handler->sim);
+	if (scsi_swap_sim_init(&handler->sim) < 0)
+		goto err_log;
 #endif
 
 	mutex_init(&swap->sysfs_lock);
 
+	/* 
+	 * 映射表已经加载, 映射块的数据在本盘队列里后台读取, 
+	 * 每读一批重新排到队尾, 和swap_bio交替执行
+	 */
+	INIT_WORK(&handler->load_work, swap_load_work_handler);
+
 	// core is ok, enable it
 	swap->enable = true;
+	queue_work(handler->wq, &handler->load_work);
 
 	return 0;
+
+#ifdef CONFIG_SCSI_SIM_BADSECTORS
+err_log:
+	scsi_swap_log_destroy(&handler->log);
+	scsi_swap_core_destroy(&handler->core);
+#endif
+err_stats:
+	scsi_swap_stats_destroy(&handler->stats);
+err_wq:
+	destroy_workqueue(handler->wq);
+err_bio_set:
+	bioset_free(handler->bio_set);
+err_split_pool:
+	mempool_destroy(handler->split_pool);
+err_item_pool:
+	mempool_destroy(handler->item_pool);
+err_free:
+	kfree(handler);
+	return -1;
 }
 
 int scsi_swap_destroy(struct scsi_swap *swap)
@@ -460,31 +753,41 @@ int scsi_swap_destroy(struct scsi_swap *swap)
 	if (!swap->enable)
 		return -1;
 
-	scsi_swap_core_destroy(swap_to_swap_core(swap));
+	/* 
+	 * 先关掉入口, 等已经拿到handler的swap_bio, 检查和模拟都退出, 
+	 * 再等本盘队列里的swap_bio全部完成
+	 */
+	swap->enable = false;
+	synchronize_rcu();
+	destroy_workqueue(swap_to_swap_handler(swap)->wq);
+
+	/* 拆出的正常子bio走请求队列, 不在上面的队列里, 等它们还回池 */
+	wait_event(swap_to_swap_handler(swap)->split_wait, 
+			atomic_read(&swap_to_swap_handler(swap)->split_inflight) == 0);
+
+	/* 映射路径已经停了, 先把后台还没写的log写完 */
 	scsi_swap_log_destroy(swap_to_swap_log(swap));
+	scsi_swap_core_destroy(swap_to_swap_core(swap));
 #ifdef CONFIG_SCSI_SIM_BADSECTORS
 	scsi_swap_sim_destroy(swap_to_swap_sim(swap));
 #endif
+	scsi_swap_stats_destroy(swap_to_swap_stats(swap));
 	mutex_destroy(&swap->sysfs_lock);
+	bioset_free(swap_to_bio_set(swap));
+	mempool_destroy(swap_to_swap_handler(swap)->split_pool);
+	mempool_destroy(swap_to_swap_handler(swap)->item_pool);
 	kfree(swap->private_data);
 	return 0;
 }
 
+/* 工作队列已改为每个盘一个, 在scsi_swap_init()中创建 */
 int module_scsi_swap_init(void)
 {
-    g_swap_wq = create_workqueue("blkswap");
-    if (NULL == g_swap_wq)
-    {
-        SWAP_ERR("create blkswap workqueue fail\n");
-        return -1;
-    }
-
     return 0;
 }
 
 int module_scsi_swap_exit(void)
 {
-    destroy_workqueue(g_swap_wq);
     return 0;
 }
  
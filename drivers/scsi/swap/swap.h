@@ -12,12 +12,15 @@
 #ifndef _SCSI_SWAP_SWAP_H
 #define _SCSI_SWAP_SWAP_H
 
+#include <linux/mempool.h>
+#include <linux/genhd.h>
 #include <scsi/scsi_device.h>
 #include <scsi/scsi_swap.h>
 
 #include "core.h"
 #include "log.h"
 #include "sim.h"
+#include "stats.h"
 
 #define SWAP_INFO(fmt, ...)	\
 		printk(KERN_INFO "[" "%s:%d" "] " fmt, __func__, __LINE__, ##__VA_ARGS__)
@@ -29,10 +32,27 @@
 		printk(KERN_DEBUG "[" "%s:%d" "] " fmt, __func__, __LINE__, ##__VA_ARGS__)
 
 
+/* swap_bio工作队列统计, 除depth外只在本盘的有序队列里更新 */
+struct swap_queue_stat {
+	atomic_t depth;
+	u64 completed;
+	u64 latency_us;
+	u64 max_latency_us;
+};
+
 struct swap_handler {
 	struct scsi_swap *swap;
+	struct workqueue_struct *wq;
+	struct work_struct load_work;	/* 后台读取映射块数据, 每次一批, 和swap_bio交替执行 */
+	struct swap_queue_stat queue;
+	mempool_t *item_pool;		/* swap_bio_item, 在中断上下文分配 */
+	mempool_t *split_pool;		/* swap_split */
+	atomic_t split_inflight;	/* 还没完成的拆分bio, 销毁时等它归0再释放池 */
+	wait_queue_head_t split_wait;
+	struct bio_set *bio_set;	/* 拆分的子bio和直接读写盘的bio */
 	struct scsi_swap_core core;
 	struct scsi_swap_log log;
+	struct scsi_swap_stats stats;
 #ifdef CONFIG_SCSI_SIM_BADSECTORS
 	struct scsi_swap_sim sim;
 #endif
@@ -44,18 +64,33 @@ struct swap_handler {
 #define swap_to_swap_core(swap)	\
 	(&swap_to_swap_handler(swap)->core)
 
+#define swap_to_swap_queue(swap)	\
+	(&swap_to_swap_handler(swap)->queue)
+
+#define swap_to_swap_stats(swap)	\
+	(&swap_to_swap_handler(swap)->stats)
+
 #define swap_to_swap_sim(swap)	\
 	(&swap_to_swap_handler(swap)->sim)
 
 #define swap_to_swap_log(swap)	\
 	(&swap_to_swap_handler(swap)->log)
 
+#define swap_to_bio_set(swap)	\
+	(swap_to_swap_handler(swap)->bio_set)
+
 #define swap_to_scsi_device(swap)	\
 	container_of(swap, struct scsi_device, swap)
 
 #define core_to_swap_handler(core)	\
 	container_of(core, struct swap_handler, core)
 
+#define core_to_swap_stats(core)	\
+	(&core_to_swap_handler(core)->stats)
+
+#define log_to_swap_stats(log)	\
+	(&log_to_swap_handler(log)->stats)
+
 #define sim_to_swap_handler(sim)	\
 	container_of(sim, struct swap_handler, sim)
 
@@ -76,6 +111,22 @@ log_to_scsi_device(struct scsi_swap_log *log)
 	return swap_to_scsi_device(swap);
 }
 
+/* tracepoint里的盘号, 和blktrace一样用major,minor */
+static inline dev_t swap_devt(struct scsi_swap *swap)
+{
+	return swap->disk ? disk_devt(swap->disk) : 0;
+}
+
+static inline dev_t core_to_devt(struct scsi_swap_core *core)
+{
+	return swap_devt(core_to_swap_handler(core)->swap);
+}
+
+static inline dev_t log_to_devt(struct scsi_swap_log *log)
+{
+	return swap_devt(log_to_swap_handler(log)->swap);
+}
+
 #ifdef CONFIG_SCSI_SIM_BADSECTORS
 static inline struct scsi_device *
 sim_to_scsi_device(struct scsi_swap_sim *sim)
@@ -9,6 +9,9 @@
  *         Modify:  
  * =================================================================================
  */
+#include <linux/math64.h>
+#include <linux/blkdev.h>
+
 #include "swap.h"
 
 struct swap_sysfs_entry {
@@ -53,6 +56,78 @@ static struct swap_sysfs_entry swap_log_entry = {
 	.store = swap_log_store,
 };
 
+static ssize_t
+swap_cache_show(struct scsi_swap *swap, char *page)
+{
+	return scsi_swap_core_cache_show(swap_to_swap_core(swap), page);
+}
+
+static struct swap_sysfs_entry swap_cache_entry = {
+	.attr = {.name = "cache", .mode = S_IRUGO },
+	.show = swap_cache_show,
+};
+
+static ssize_t
+swap_queue_show(struct scsi_swap *swap, char *page)
+{
+	struct swap_queue_stat *stat = swap_to_swap_queue(swap);
+	u64 completed = stat->completed;
+
+	return sprintf(page, "depth %d\ncompleted %llu\n"
+			"avg_latency_us %llu\nmax_latency_us %llu\n",
+			atomic_read(&stat->depth),
+			(unsigned long long)completed,
+			completed ? (unsigned long long)div64_u64(stat->latency_us, completed) : 0ULL,
+			(unsigned long long)stat->max_latency_us);
+}
+
+static struct swap_sysfs_entry swap_queue_entry = {
+	.attr = {.name = "queue", .mode = S_IRUGO },
+	.show = swap_queue_show,
+};
+
+static ssize_t
+swap_stats_show(struct scsi_swap *swap, char *page)
+{
+	return scsi_swap_stats_show(swap_to_swap_stats(swap), page);
+}
+
+static struct swap_sysfs_entry swap_stats_entry = {
+	.attr = {.name = "stats", .mode = S_IRUGO },
+	.show = swap_stats_show,
+};
+
+/* 
+ * 二进制的映射表和log, 记录格式见include/scsi/scsi_swap.h, 
+ * 可以分多次读完, 不受一页的限制
+ */
+static ssize_t
+swap_table_bin_read(struct file *filp, struct kobject *kobj, 
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct scsi_swap *swap = container_of(kobj, struct scsi_swap, kobj);
+
+	return scsi_swap_core_read_table(swap_to_swap_core(swap), buf, off, count);
+}
+
+static struct bin_attribute swap_table_bin_attr = {
+	.attr = {.name = "table_bin", .mode = S_IRUGO },
+	.read = swap_table_bin_read,
+};
+
+static ssize_t
+swap_log_bin_read(struct file *filp, struct kobject *kobj, 
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct scsi_swap *swap = container_of(kobj, struct scsi_swap, kobj);
+
+	return scsi_swap_log_read(swap_to_swap_log(swap), buf, off, count);
+}
+
+static struct bin_attribute swap_log_bin_attr = {
+	.attr = {.name = "log_bin", .mode = S_IRUGO },
+	.read = swap_log_bin_read,
+};
 
 #ifdef CONFIG_SCSI_SIM_BADSECTORS
 static ssize_t 
@@ -64,15 +139,27 @@ swap_sim_show(struct scsi_swap *swap, char *page)
 static ssize_t
 swap_sim_store(struct scsi_swap *swap, const char *page, size_t count)
 {	
+	struct scsi_swap_sim *sim = swap_to_swap_sim(swap);
 	sector_t sector;
 	u32 num;
-
-	if (sscanf(page, "add %llu %u", 
-				(unsigned long long*)&sector, &num) == 2)
-		scsi_swap_sim_add(swap_to_swap_sim(swap), sector, num);
-	else if (sscanf(page, "remove %llu %u", 
+	char dir[4] = "w";
+	u32 percent = 100;
+	u32 delay_ms = 0;
+	struct request_queue *q = swap_to_scsi_device(swap)->request_queue;
+
+	/* add 扇区 个数 [r|w|rw] [失败概率0~100] [延迟ms], 默认只模拟写, 总是失败 */
+	if (sscanf(page, "add %llu %u %3s %u %u", 
+				(unsigned long long*)&sector, &num, 
+				dir, &percent, &delay_ms) >= 2) {
+		if (!scsi_swap_sim_delay_ok(q->rq_timeout, delay_ms))
+			return -EINVAL;
+		if (strchr(dir, 'r'))
+			scsi_swap_sim_add(sim, SIM_READ, sector, num, percent, delay_ms);
+		if (strchr(dir, 'w'))
+			scsi_swap_sim_add(sim, SIM_WRITE, sector, num, percent, delay_ms);
+	} else if (sscanf(page, "remove %llu %u", 
 				(unsigned long long*)&sector, &num) == 2)
-		scsi_swap_sim_remove(swap_to_swap_sim(swap), sector, num);
+		scsi_swap_sim_remove(sim, sector, num);
 
 	return count;
 }
@@ -111,6 +198,9 @@ static struct swap_sysfs_entry swap_log_entry = {
 static struct attribute *default_attrs[] = {
 	&swap_swap_entry.attr,
 	&swap_log_entry.attr,
+	&swap_queue_entry.attr,
+	&swap_cache_entry.attr,
+	&swap_stats_entry.attr,
 #ifdef CONFIG_SCSI_SIM_BADSECTORS
 	&swap_sim_entry.attr,
 #endif
@@ -183,8 +273,23 @@ int scsi_swap_register_sysfs(struct scsi_swap *swap)
 	if (ret < 0)
 		return ret;
 
+	ret = sysfs_create_bin_file(kobj, &swap_table_bin_attr);
+	if (ret < 0)
+		goto err_del;
+
+	ret = sysfs_create_bin_file(kobj, &swap_log_bin_attr);
+	if (ret < 0)
+		goto err_table;
+
 	kobject_uevent(kobj, KOBJ_ADD);
 	return 0;
+
+err_table:
+	sysfs_remove_bin_file(kobj, &swap_table_bin_attr);
+err_del:
+	kobject_del(kobj);
+	kobject_put(&dev->kobj);
+	return ret;
 }
 
 int scsi_swap_unregister_sysfs(struct scsi_swap *swap)
@@ -196,6 +301,8 @@ int scsi_swap_unregister_sysfs(struct scsi_swap *swap)
 		return -1;
 
 	kobject_uevent(kobj, KOBJ_REMOVE);
+	sysfs_remove_bin_file(kobj, &swap_log_bin_attr);
+	sysfs_remove_bin_file(kobj, &swap_table_bin_attr);
 	kobject_del(kobj);
 	kobject_put(&dev->kobj);
 	return 0;
@@ -18,6 +18,12 @@
 #include <asm-generic/bitops/find.h>
 #include <linux/dma-mapping.h>
 #include <linux/delay.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+#include <linux/completion.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
 #include <scsi/scsi.h>
 #include <scsi/scsi_eh.h>
 #include <scsi/scsi_device.h>
@@ -26,18 +32,83 @@
 #include "utils.h"
 #include "swap.h"
 
+#include <trace/events/scsi_swap.h>
+
 #define SWAP_DEFAULT_TIMEOUT            (10*HZ)
 #define SWAP_DEFAULT_RETRIES            5
 
+/* 
+ * 调用者都用512字节扇区, 命令里要用盘的逻辑块. 
+ * 4Kn盘上没有对齐到逻辑块的读写直接返回失败
+ */
+static int hd_to_lba(struct scsi_device *sdev, sector_t sector, u32 sec_num, 
+    sector_t *lba, u32 *blk_num)
+{
+    int shift = sdev->sector_size > SECTOR_SIZE ? ilog2(sdev->sector_size) - 9 : 0;
+    u32 mask = (1U << shift) - 1;
+
+    if (((u32)sector & mask) || (sec_num & mask))
+    {
+        SWAP_ERR("unaligned io %llu, %u, sector size %u\n", 
+                (unsigned long long)sector, sec_num, sdev->sector_size);
+        return -1;
+    }
+
+    *lba = sector >> shift;
+    *blk_num = sec_num >> shift;
+    return 0;
+}
+
+/*
+ * 组读写命令, 返回命令长度. 超过2T的LBA或者超过0xffff个块时用16字节命令,
+ * 否则用10字节命令
+ */
+static int hd_rw_cdb(struct scsi_device *sdev, u8 *cdb, int rw, sector_t lba, u32 blk_num)
+{
+    u64 lba64 = lba;
+
+    memset(cdb, 0, 16);
+
+    if (sdev->use_16_for_rw || lba64 + blk_num > 0xffffffffULL || blk_num > 0xffff)
+    {
+        cdb[0] = (rw == WRITE) ? WRITE_16 : READ_16;
+        cdb[2] = (lba64 >> 56) & 0xff;
+        cdb[3] = (lba64 >> 48) & 0xff;
+        cdb[4] = (lba64 >> 40) & 0xff;
+        cdb[5] = (lba64 >> 32) & 0xff;
+        cdb[6] = (lba64 >> 24) & 0xff;
+        cdb[7] = (lba64 >> 16) & 0xff;
+        cdb[8] = (lba64 >> 8) & 0xff;
+        cdb[9] = lba64 & 0xff;
+        cdb[10] = (blk_num >> 24) & 0xff;
+        cdb[11] = (blk_num >> 16) & 0xff;
+        cdb[12] = (blk_num >> 8) & 0xff;
+        cdb[13] = blk_num & 0xff;
+        return 16;
+    }
+
+    cdb[0] = (rw == WRITE) ? WRITE_10 : READ_10;
+    cdb[2] = (lba64 >> 24) & 0xff;
+    cdb[3] = (lba64 >> 16) & 0xff;
+    cdb[4] = (lba64 >> 8) & 0xff;
+    cdb[5] = lba64 & 0xff;
+    cdb[7] = (blk_num >> 8) & 0xff;
+    cdb[8] = blk_num & 0xff;
+    return 10;
+}
+
 s32 hd_read_sector(struct scsi_device *sdev, sector_t sector, 
     u32 sec_num, void *buf, s32 len, int timeout, int retries)
 {
-    s8 cdb[32]={READ_10,0x00,0x00, 0x00,0x00,0x00, 0x00,0x00,0x00,0x00};
-    s8 *cmnd = cdb;
+    u8 cdb[32] = {0};
+    u8 *cmnd = cdb;
     u8 sense[SCSI_SENSE_BUFFERSIZE] = {0};
     s32 ret = 0;
     s32 host_status = 0;
     s32 resid = 0;
+    sector_t lba;
+    u32 blk_num;
+    ktime_t start = ktime_set(0, 0);
     struct scsi_sense_hdr sshdr;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 14)
 	struct scsi_request *sreq;
@@ -51,15 +122,19 @@ s32 hd_read_sector(struct scsi_device *sdev, sector_t sector,
     {
         return -1;
     }
+    if (0 != hd_to_lba(sdev, sector, sec_num, &lba, &blk_num))
+    {
+        return -1;
+    }
+    if (sec_num > queue_max_hw_sectors(sdev->request_queue))
+    {
+        SWAP_ERR("transfer too large %u\n", sec_num);
+        return -1;
+    }
 
-    cdb[2] = (sector >> 24) & 0xff;
-    cdb[3] = (sector >> 16) & 0xff;
-    cdb[4] = (sector >> 8) & 0xff;
-    cdb[5] = sector &0xff;
-
-    cdb[6] = (sec_num >> 16) & 0xff;
-    cdb[7] = (sec_num >> 8) & 0xff;
-    cdb[8] = sec_num  & 0xff;
+    hd_rw_cdb(sdev, cdb, READ, lba, blk_num);
+    if (trace_scsi_swap_hd_rw_enabled())
+        start = ktime_get();
     
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 14)
 	sreq = scsi_allocate_request(sdev, GFP_KERNEL);
@@ -98,6 +173,7 @@ s32 hd_read_sector(struct scsi_device *sdev, sector_t sector,
             }
       	}
   	}
+    trace_scsi_swap_hd_rw(swap_devt(&sdev->swap), READ, sector, sec_num, ret, start);
 
     if(ret != 0)
     {
@@ -118,6 +194,421 @@ s32 hd_read_sector(struct scsi_device *sdev, sector_t sector,
 }
 
 
+static int hd_sg_result(struct scsi_device *sdev, int ret, u8 *sense)
+{
+    struct scsi_sense_hdr sshdr;
+    s32 host_status = 0;
+
+    if (driver_byte(ret) == DRIVER_SENSE) 
+    {
+        /* sense data available */
+      	ret &= ~(0xFF<<24); /* DRIVER_SENSE is not an error */
+
+      	if (ret & SAM_STAT_CHECK_CONDITION) 
+        {
+          	scsi_normalize_sense(sense, SCSI_SENSE_BUFFERSIZE, &sshdr);
+          	if ((sshdr.sense_key == 0) && (sshdr.asc == 0) && (sshdr.ascq == 0))
+            { 
+              	ret &= ~SAM_STAT_CHECK_CONDITION;
+            }
+      	}
+  	}
+
+    if(ret != 0)
+    {
+        host_status = host_byte(ret);
+        if ((DID_NO_CONNECT == host_status) || (DID_BAD_TARGET == host_status))
+        {
+            struct scsi_swap_core *core = swap_to_swap_core(&sdev->swap);
+            if(core)
+            {
+                atomic_inc(&core->device_dead);
+            }
+        }
+    
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 用游标当前位置开始的len字节, 建一个直接指向bio页面的bio, 从本盘的bio_set分配 */
+struct bio *swap_sg_bio(struct swap_sg *sg, u32 len, int rw, gfp_t gfp, struct bio_set *bs)
+{
+    struct bio_vec *src = sg->bio->bi_io_vec + sg->idx;
+    struct bio_vec *dst;
+    struct bio *bio;
+    unsigned int offset = sg->offset;
+    u32 left = len;
+    int nr = 0;
+    int i;
+
+    for (i = sg->idx; left > 0 && i < sg->bio->bi_vcnt; i++, offset = 0)
+    {
+        left -= min(left, sg->bio->bi_io_vec[i].bv_len - offset);
+        nr++;
+    }
+    if (left > 0)
+    {
+        return NULL;
+    }
+
+    bio = bio_alloc_bioset(gfp, nr, bs);
+    if (NULL == bio)
+    {
+        return NULL;
+    }
+
+    offset = sg->offset;
+    left = len;
+    for (dst = bio->bi_io_vec; left > 0; src++, dst++, offset = 0)
+    {
+        dst->bv_page = src->bv_page;
+        dst->bv_offset = src->bv_offset + offset;
+        dst->bv_len = min(left, src->bv_len - offset);
+        left -= dst->bv_len;
+    }
+
+    bio->bi_vcnt = nr;
+    bio->bi_size = len;
+    bio->bi_rw = rw;
+
+    return bio;
+}
+
+/* 内核缓冲建bio, 缓冲必须是kmalloc的, 在线性映射区里 */
+struct bio *swap_kern_bio(void *buf, u32 len, int rw, gfp_t gfp, struct bio_set *bs)
+{
+    unsigned long start = (unsigned long)buf;
+    unsigned long end = start + len;
+    int nr = ((end + PAGE_SIZE - 1) >> PAGE_SHIFT) - (start >> PAGE_SHIFT);
+    unsigned int offset = offset_in_page(buf);
+    char *p = buf;
+    struct bio *bio;
+    u32 left = len;
+    int i;
+
+    bio = bio_alloc_bioset(gfp, nr, bs);
+    if (NULL == bio)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < nr; i++, offset = 0)
+    {
+        bio->bi_io_vec[i].bv_page = virt_to_page(p);
+        bio->bi_io_vec[i].bv_offset = offset;
+        bio->bi_io_vec[i].bv_len = min_t(u32, left, PAGE_SIZE - offset);
+        p += bio->bi_io_vec[i].bv_len;
+        left -= bio->bi_io_vec[i].bv_len;
+    }
+
+    bio->bi_vcnt = nr;
+    bio->bi_size = len;
+    bio->bi_rw = rw;
+
+    return bio;
+}
+
+void swap_aio_init(struct swap_aio *aio)
+{
+    /* 多一个计数, swap_aio_wait里减掉, 防止提交过程中提前完成 */
+    atomic_set(&aio->pending, 1);
+    init_completion(&aio->done);
+}
+
+void swap_aio_wait(struct swap_aio *aio)
+{
+    if (!atomic_dec_and_test(&aio->pending))
+    {
+        wait_for_completion(&aio->done);
+    }
+}
+
+/* 请求完成回调, 调用时持有queue_lock */
+static void hd_aio_end_io(struct request *rq, int error)
+{
+    struct swap_aio_req *req = rq->end_io_data;
+    struct swap_aio *aio = req->aio;
+
+    req->result = hd_sg_result(req->sdev, rq->errors, req->sense);
+    trace_scsi_swap_hd_rw(swap_devt(&req->sdev->swap), req->rw, req->sector, 
+            req->sec_num, req->result, req->start);
+
+    __blk_put_request(rq->q, rq);
+    if (NULL != req->bio)
+    {
+        bio_put(req->bio);
+        req->bio = NULL;
+    }
+
+    if (atomic_dec_and_test(&aio->pending))
+    {
+        complete(&aio->done);
+    }
+}
+
+static void hd_submit_rq(struct scsi_device *sdev, struct request *rq, int rw, sector_t lba, 
+    u32 blk_num, struct swap_aio_req *req, struct swap_aio *aio, int timeout, int retries)
+{
+    rq->cmd_type = REQ_TYPE_BLOCK_PC;
+    rq->cmd_flags |= REQ_QUIET;
+    memset(rq->cmd, 0, BLK_MAX_CDB);
+    rq->cmd_len = hd_rw_cdb(sdev, rq->cmd, rw, lba, blk_num);
+    memset(req->sense, 0, sizeof(req->sense));
+    rq->sense = req->sense;
+    rq->sense_len = 0;
+    rq->timeout = timeout;
+    rq->retries = retries;
+    rq->end_io_data = req;
+    req->start = trace_scsi_swap_hd_rw_enabled() ? ktime_get() : ktime_set(0, 0);
+
+    atomic_inc(&aio->pending);
+    blk_execute_rq_nowait(rq->q, NULL, rq, 0, hd_aio_end_io);
+}
+
+/* 一个请求里最多的扇区数, 不超过队列的max_hw_sectors, 按逻辑块对齐 */
+static u32 hd_align_fit(struct scsi_device *sdev, u32 sec_num, u32 bytes)
+{
+    u32 unit = max(sdev->sector_size, (unsigned)SECTOR_SIZE) / SECTOR_SIZE;
+    u32 n = min(sec_num, queue_max_hw_sectors(sdev->request_queue));
+
+    n = min(n, bytes / SECTOR_SIZE);
+    return n - n % unit;
+}
+
+/* 从游标开始的sec_num个扇区, 一个请求能装下的扇区数, 每个bio_vec算一个段 */
+static u32 hd_sg_fit(struct scsi_device *sdev, struct swap_sg *sg, u32 sec_num)
+{
+    struct bio_vec *bv = sg->bio->bi_io_vec + sg->idx;
+    struct bio_vec *last = sg->bio->bi_io_vec + sg->bio->bi_vcnt;
+    unsigned int offset = sg->offset;
+    unsigned short segs = 0;
+    u32 bytes = 0;
+
+    while (bytes < sec_num * SECTOR_SIZE && bv < last
+            && segs < queue_max_segments(sdev->request_queue))
+    {
+        bytes += bv->bv_len - offset;
+        offset = 0;
+        bv++;
+        segs++;
+    }
+
+    return hd_align_fit(sdev, sec_num, bytes);
+}
+
+/* 内核缓冲一个请求能装下的扇区数, 每页一个段 */
+static u32 hd_buf_fit(struct scsi_device *sdev, void *buf, u32 sec_num)
+{
+    u32 bytes = queue_max_segments(sdev->request_queue) * PAGE_SIZE - offset_in_page(buf);
+
+    return hd_align_fit(sdev, sec_num, bytes);
+}
+
+/* 
+ * 超过一个请求的限制时按限制分段, 依次同步完成, 结果记在req里.
+ * 只有队列限制很小的HBA会走到这里
+ */
+static void hd_submit_sg_split(struct scsi_device *sdev, int rw, sector_t sector, 
+    u32 sec_num, struct swap_sg *sg, struct swap_aio_req *req)
+{
+    struct swap_sg pos = *sg;
+    struct swap_aio aio;
+    struct swap_aio_req sub;
+    u32 n;
+
+    while (sec_num > 0)
+    {
+        n = hd_sg_fit(sdev, &pos, sec_num);
+        if (0 == n)
+        {
+            req->result = -EINVAL;
+            return;
+        }
+
+        swap_aio_init(&aio);
+        hd_submit_sg(sdev, rw, sector, n, &pos, &sub, &aio);
+        swap_aio_wait(&aio);
+        if (0 != sub.result)
+        {
+            req->result = sub.result;
+            return;
+        }
+
+        swap_sg_skip(&pos, n * SECTOR_SIZE);
+        sector += n;
+        sec_num -= n;
+    }
+
+    req->result = 0;
+}
+
+static void hd_submit_sector_split(struct scsi_device *sdev, int rw, sector_t sector, 
+    u32 sec_num, void *buf, struct swap_aio_req *req)
+{
+    struct swap_aio aio;
+    struct swap_aio_req sub;
+    char *p = buf;
+    u32 n;
+
+    while (sec_num > 0)
+    {
+        n = hd_buf_fit(sdev, p, sec_num);
+        if (0 == n)
+        {
+            req->result = -EINVAL;
+            return;
+        }
+
+        swap_aio_init(&aio);
+        hd_submit_sector(sdev, rw, sector, n, p, n * SECTOR_SIZE, &sub, &aio);
+        swap_aio_wait(&aio);
+        if (0 != sub.result)
+        {
+            req->result = sub.result;
+            return;
+        }
+
+        p += n * SECTOR_SIZE;
+        sector += n;
+        sec_num -= n;
+    }
+
+    req->result = 0;
+}
+
+/* 
+ * 异步读写, 数据直接在bio的页面里, 不经过中间缓冲. 
+ * 结果在swap_aio_wait返回后从req->result取得
+ */
+void hd_submit_sg(struct scsi_device *sdev, int rw, sector_t sector, 
+    u32 sec_num, struct swap_sg *sg, struct swap_aio_req *req, struct swap_aio *aio)
+{
+    struct request *rq;
+    sector_t lba;
+    u32 blk_num;
+
+    req->aio = aio;
+    req->sdev = sdev;
+    req->bio = NULL;
+    req->result = -1;
+    req->rw = rw;
+    req->sector = sector;
+    req->sec_num = sec_num;
+
+    /* 超过队列的max_hw_sectors或段数时分段提交, 不能当成盘上的错误 */
+    if (hd_sg_fit(sdev, sg, sec_num) < sec_num)
+    {
+        hd_submit_sg_split(sdev, rw, sector, sec_num, sg, req);
+        return;
+    }
+
+    if (0 != hd_to_lba(sdev, sector, sec_num, &lba, &blk_num))
+    {
+        req->result = -EINVAL;
+        return;
+    }
+
+    req->bio = swap_sg_bio(sg, sec_num * SECTOR_SIZE, rw, GFP_NOIO, 
+            swap_to_bio_set(&sdev->swap));
+    if (NULL == req->bio)
+    {
+        req->result = -ENOMEM;
+        return;
+    }
+
+    rq = blk_make_request(sdev->request_queue, req->bio, GFP_NOIO);
+    if (IS_ERR(rq))
+    {
+        req->result = PTR_ERR(rq);
+        bio_put(req->bio);
+        req->bio = NULL;
+        return;
+    }
+
+    hd_submit_rq(sdev, rq, rw, lba, blk_num, req, aio, SWAP_DEFAULT_TIMEOUT, SWAP_DEFAULT_RETRIES);
+}
+
+/* 
+ * 异步读写内核缓冲, 缓冲在完成前必须保持有效. 
+ * bio从本盘的bio_set分配, request从队列的request池分配, 都可以等待, 不会失败
+ */
+void hd_submit_sector(struct scsi_device *sdev, int rw, sector_t sector, 
+    u32 sec_num, void *buf, s32 len, struct swap_aio_req *req, struct swap_aio *aio)
+{
+    struct request *rq;
+    sector_t lba;
+    u32 blk_num;
+
+    req->aio = aio;
+    req->sdev = sdev;
+    req->bio = NULL;
+    req->result = -1;
+    req->rw = rw;
+    req->sector = sector;
+    req->sec_num = sec_num;
+
+    if(len < SECTOR_SIZE * sec_num)
+    {
+        req->result = -EINVAL;
+        return;
+    }
+    if (hd_buf_fit(sdev, buf, sec_num) < sec_num)
+    {
+        hd_submit_sector_split(sdev, rw, sector, sec_num, buf, req);
+        return;
+    }
+    if (0 != hd_to_lba(sdev, sector, sec_num, &lba, &blk_num))
+    {
+        req->result = -EINVAL;
+        return;
+    }
+
+    req->bio = swap_kern_bio(buf, sec_num * SECTOR_SIZE, rw, GFP_NOIO, 
+            swap_to_bio_set(&sdev->swap));
+    if (NULL == req->bio)
+    {
+        req->result = -ENOMEM;
+        return;
+    }
+
+    rq = blk_make_request(sdev->request_queue, req->bio, GFP_NOIO);
+    if (IS_ERR(rq))
+    {
+        req->result = PTR_ERR(rq);
+        bio_put(req->bio);
+        req->bio = NULL;
+        return;
+    }
+
+    hd_submit_rq(sdev, rq, rw, lba, blk_num, req, aio, SWAP_DEFAULT_TIMEOUT, SWAP_DEFAULT_RETRIES);
+}
+
+static s32 hd_rw_sg(struct scsi_device *sdev, int rw, sector_t sector, 
+    u32 sec_num, struct swap_sg *sg)
+{
+    struct swap_aio aio;
+    struct swap_aio_req req;
+
+    if((sdev == NULL) || (sg == NULL))
+    {
+        return -1;
+    }
+
+    swap_aio_init(&aio);
+    hd_submit_sg(sdev, rw, sector, sec_num, sg, &req, &aio);
+    swap_aio_wait(&aio);
+
+    return req.result;
+}
+
+s32 hd_write_sg_retry(struct scsi_device *sdev, sector_t sector, 
+    u32 sec_num, struct swap_sg *sg)
+{
+    return hd_rw_sg(sdev, WRITE, sector, sec_num, sg);
+}
+
 s32 hd_read_sector_retry(struct scsi_device *sdev, sector_t sector, 
     u32 sec_num, void *buf, s32 len)
 {
@@ -133,12 +624,15 @@ s32 hd_read_sector_no_retry(struct scsi_device *sdev, sector_t sector,
 s32 hd_write_sector(struct scsi_device *sdev, sector_t sector, 
     u32 sec_num, void *buf, s32 len, int timeout, int retries)
 {
-    s8 cdb[32]={WRITE_10,0x00,0x00, 0x00,0x00,0x00, 0x00,0x00,0x00,0x00};
-    s8 *cmnd = cdb;
+    u8 cdb[32] = {0};
+    u8 *cmnd = cdb;
     u8 sense[SCSI_SENSE_BUFFERSIZE] = {0};
     s32 ret = 0;
     s32 host_status = 0;
     s32 resid = 0;
+    sector_t lba;
+    u32 blk_num;
+    ktime_t start = ktime_set(0, 0);
     struct scsi_sense_hdr sshdr;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 14)
 	struct scsi_request *sreq;
@@ -152,15 +646,19 @@ s32 hd_write_sector(struct scsi_device *sdev, sector_t sector,
     {
         return -1;
     }
+    if (0 != hd_to_lba(sdev, sector, sec_num, &lba, &blk_num))
+    {
+        return -1;
+    }
+    if (sec_num > queue_max_hw_sectors(sdev->request_queue))
+    {
+        SWAP_ERR("transfer too large %u\n", sec_num);
+        return -1;
+    }
 
-    cdb[2] = (sector >> 24) & 0xff;
-    cdb[3] = (sector >> 16) & 0xff;
-    cdb[4] = (sector >> 8) & 0xff;
-    cdb[5] = sector &0xff;
-
-    cdb[6] = (sec_num >> 16) & 0xff;
-    cdb[7] = (sec_num >> 8) & 0xff;
-    cdb[8] = sec_num  & 0xff;
+    hd_rw_cdb(sdev, cdb, WRITE, lba, blk_num);
+    if (trace_scsi_swap_hd_rw_enabled())
+        start = ktime_get();
     
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 14)
 	sreq = scsi_allocate_request(sdev, GFP_KERNEL);
@@ -199,6 +697,7 @@ s32 hd_write_sector(struct scsi_device *sdev, sector_t sector,
             }
       	}
   	}
+    trace_scsi_swap_hd_rw(swap_devt(&sdev->swap), WRITE, sector, sec_num, ret, start);
     
     if(ret != 0)
     {
@@ -427,3 +926,76 @@ int hd_sync_cache(struct scsi_device *sdev)
 	return 0;
 }
 
+
+void swap_sg_init(struct swap_sg *sg, struct bio *bio)
+{
+	sg->bio = bio;
+	sg->idx = bio->bi_idx;
+	sg->offset = 0;
+}
+
+void swap_sg_skip(struct swap_sg *sg, u32 len)
+{
+	struct bio_vec *bvec;
+	u32 n;
+
+	while (len > 0 && sg->idx < sg->bio->bi_vcnt) {
+		bvec = &sg->bio->bi_io_vec[sg->idx];
+		n = min(len, bvec->bv_len - sg->offset);
+		sg->offset += n;
+		len -= n;
+		if (sg->offset == bvec->bv_len) {
+			sg->idx++;
+			sg->offset = 0;
+		}
+	}
+}
+
+#define SWAP_SG_TO_BUF		0
+#define SWAP_SG_FROM_BUF	1
+#define SWAP_SG_ZERO		2
+
+/* 在游标当前位置和buf之间复制len字节, 不移动游标 */
+static void swap_sg_copy(struct swap_sg *sg, char *buf, u32 len, int op)
+{
+	struct swap_sg pos = *sg;
+	struct bio_vec *bvec;
+	char *base;
+	char *addr;
+	u32 n;
+
+	while (len > 0 && pos.idx < pos.bio->bi_vcnt) {
+		bvec = &pos.bio->bi_io_vec[pos.idx];
+		n = min(len, bvec->bv_len - pos.offset);
+
+		base = kmap_atomic(bvec->bv_page);
+		addr = base + bvec->bv_offset + pos.offset;
+		if (op == SWAP_SG_TO_BUF)
+			memcpy(buf, addr, n);
+		else if (op == SWAP_SG_FROM_BUF)
+			memcpy(addr, buf, n);
+		else
+			memset(addr, 0, n);
+		kunmap_atomic(base);
+
+		if (buf)
+			buf += n;
+		len -= n;
+		swap_sg_skip(&pos, n);
+	}
+}
+
+void swap_sg_to_buf(struct swap_sg *sg, void *buf, u32 len)
+{
+	swap_sg_copy(sg, buf, len, SWAP_SG_TO_BUF);
+}
+
+void swap_sg_from_buf(struct swap_sg *sg, const void *buf, u32 len)
+{
+	swap_sg_copy(sg, (char *)buf, len, SWAP_SG_FROM_BUF);
+}
+
+void swap_sg_zero(struct swap_sg *sg, u32 len)
+{
+	swap_sg_copy(sg, NULL, len, SWAP_SG_ZERO);
+}
@@ -9,10 +9,50 @@
  *         Modify:  
  * =====================================================================================
  */
+#ifndef _SCSI_SWAP_UTILS_H
+#define _SCSI_SWAP_UTILS_H
+
 #include <linux/types.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <scsi/scsi_cmnd.h>
 
+struct bio;
+struct bio_set;
 struct scsi_device;
 
+/* bio数据的游标, 用于直接读写bio的页面 */
+struct swap_sg {
+	struct bio *bio;
+	int idx;			/* 当前bio_vec */
+	unsigned int offset;	/* 当前bio_vec内的偏移 */
+};
+
+/* 一组并发的异步硬盘读写, swap_aio_wait等待全部完成 */
+struct swap_aio {
+	atomic_t pending;
+	struct completion done;
+};
+
+/* 一个异步请求, 完成前调用者必须保证其有效 */
+struct swap_aio_req {
+	struct swap_aio *aio;
+	struct scsi_device *sdev;
+	struct bio *bio;
+	int result;			/* 0 成功 -1 盘上失败 其他 没有发出去, 如-ENOMEM */
+	u8 sense[SCSI_SENSE_BUFFERSIZE];
+	int rw;				/* 下面几项给tracepoint用 */
+	sector_t sector;
+	u32 sec_num;
+	ktime_t start;		/* 只在scsi_swap_hd_rw打开时取 */
+};
+
+/* 命令没有发到盘上, 不是介质错误, 不能因此建映射 */
+static inline int hd_result_unsent(int result)
+{
+    return (0 != result && -1 != result);
+}
+
 s32 hd_read_sector(struct scsi_device *sdev, sector_t sector, 
     u32 sec_num, void *buf, s32 len, int timeout, int retries);
 
@@ -39,3 +79,25 @@ s32 hd_reassign_successive_sectors(struct scsi_device *sdev, sector_t sector, in
 int hd_test_unit_ready(struct scsi_device *sdev);
 
 int hd_sync_cache(struct scsi_device *sdev);
+
+void swap_sg_init(struct swap_sg *sg, struct bio *bio);
+void swap_sg_skip(struct swap_sg *sg, u32 len);
+void swap_sg_to_buf(struct swap_sg *sg, void *buf, u32 len);
+void swap_sg_from_buf(struct swap_sg *sg, const void *buf, u32 len);
+void swap_sg_zero(struct swap_sg *sg, u32 len);
+struct bio *swap_sg_bio(struct swap_sg *sg, u32 len, int rw, gfp_t gfp, struct bio_set *bs);
+struct bio *swap_kern_bio(void *buf, u32 len, int rw, gfp_t gfp, struct bio_set *bs);
+
+void swap_aio_init(struct swap_aio *aio);
+void swap_aio_wait(struct swap_aio *aio);
+
+void hd_submit_sg(struct scsi_device *sdev, int rw, sector_t sector, 
+    u32 sec_num, struct swap_sg *sg, struct swap_aio_req *req, struct swap_aio *aio);
+
+void hd_submit_sector(struct scsi_device *sdev, int rw, sector_t sector, 
+    u32 sec_num, void *buf, s32 len, struct swap_aio_req *req, struct swap_aio *aio);
+
+s32 hd_write_sg_retry(struct scsi_device *sdev, sector_t sector, 
+    u32 sec_num, struct swap_sg *sg);
+
+#endif
@@ -4,9 +4,12 @@
 #include <linux/types.h>
 #include <linux/kobject.h>
 #include <linux/mutex.h>
+#include <linux/jump_label.h>
+#include <uapi/scsi/scsi_swap.h>
 
 struct bio;
 struct gendisk;
+struct hd_struct;
 struct scsi_swap;
 struct scsi_cmnd;
 struct scsi_disk;
@@ -32,8 +35,38 @@ int scsi_swap_destroy(struct scsi_swap *swap);
 int scsi_swap_register_sysfs(struct scsi_swap *swap);
 int scsi_swap_unregister_sysfs(struct scsi_swap *swap);
 
-bool scmd_should_be_bad(struct scsi_cmnd *scmd);
-bool bio_has_bad_block (struct bio *bio);
-bool swap_bio(struct bio *bio, sector_t sector, int size, sector_t bad_sec, int error, int may_create);
+bool __scmd_simulate_done(struct scsi_cmnd *scmd);
+bool __bio_has_bad_block(struct bio *bio);
+bool swap_bio(struct bio *bio, struct hd_struct *part, sector_t sector, int size, 
+		sector_t bad_sec, int error, int may_create);
+bool swap_split_bio(struct bio *bio);
+
+extern struct static_key scsi_swap_remap_key;
+
+/*
+ * Called for every bio in generic_make_request(). Until some disk has at
+ * least one remapped block this is a single patched-out branch.
+ */
+static inline bool bio_has_bad_block(struct bio *bio)
+{
+	if (!static_key_false(&scsi_swap_remap_key))
+		return false;
+	return __bio_has_bad_block(bio);
+}
+
+#ifdef CONFIG_SCSI_SIM_BADSECTORS
+extern struct static_key scsi_swap_sim_key;
+
+/*
+ * Called from scsi_done() for every command. Only enabled while some disk
+ * has at least one simulated range configured.
+ */
+static inline bool scmd_simulate_done(struct scsi_cmnd *scmd)
+{
+	if (!static_key_false(&scsi_swap_sim_key))
+		return false;
+	return __scmd_simulate_done(scmd);
+}
+#endif
                                                                                                                                                   
 #endif 
@@ -0,0 +1,304 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scsi_swap
+
+#if !defined(_TRACE_SCSI_SWAP_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_SCSI_SWAP_H
+
+#include <linux/kdev_t.h>
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Remapped bios complete in the per-disk swap workqueue and never reach
+ * the request queue, so blktrace does not see them. These events cover
+ * the remap path from bio_has_bad_block() down to the synchronous SCSI
+ * commands issued by the hd_* helpers. Durations are in microseconds
+ * and are computed only when the event is enabled.
+ */
+
+TRACE_EVENT(scsi_swap_bio_check,
+
+	TP_PROTO(dev_t dev, sector_t sector, unsigned int nr_sectors),
+
+	TP_ARGS(dev, sector, nr_sectors),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	sector_t,	sector		)
+		__field(	unsigned int,	nr_sectors	)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->sector		= sector;
+		__entry->nr_sectors	= nr_sectors;
+	),
+
+	TP_printk("%d,%d %llu + %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector, __entry->nr_sectors)
+);
+
+TRACE_EVENT(scsi_swap_bio_queue,
+
+	TP_PROTO(dev_t dev, int rw, sector_t sector, unsigned int nr_sectors,
+		 sector_t bad_sec),
+
+	TP_ARGS(dev, rw, sector, nr_sectors, bad_sec),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	int,		rw		)
+		__field(	sector_t,	sector		)
+		__field(	unsigned int,	nr_sectors	)
+		__field(	sector_t,	bad_sec		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->rw		= rw;
+		__entry->sector		= sector;
+		__entry->nr_sectors	= nr_sectors;
+		__entry->bad_sec	= bad_sec;
+	),
+
+	TP_printk("%d,%d %s %llu + %u bad %lld",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->rw ? "W" : "R",
+		  (unsigned long long)__entry->sector, __entry->nr_sectors,
+		  (long long)__entry->bad_sec)
+);
+
+TRACE_EVENT(scsi_swap_bio_start,
+
+	TP_PROTO(dev_t dev, int rw, sector_t sector, unsigned int nr_sectors,
+		 ktime_t queued),
+
+	TP_ARGS(dev, rw, sector, nr_sectors, queued),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	int,		rw		)
+		__field(	sector_t,	sector		)
+		__field(	unsigned int,	nr_sectors	)
+		__field(	s64,		wait_us		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->rw		= rw;
+		__entry->sector		= sector;
+		__entry->nr_sectors	= nr_sectors;
+		__entry->wait_us	= ktime_us_delta(ktime_get(), queued);
+	),
+
+	TP_printk("%d,%d %s %llu + %u wait %lldus",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->rw ? "W" : "R",
+		  (unsigned long long)__entry->sector, __entry->nr_sectors,
+		  (long long)__entry->wait_us)
+);
+
+TRACE_EVENT(scsi_swap_bio_done,
+
+	TP_PROTO(dev_t dev, int rw, sector_t sector, unsigned int nr_sectors,
+		 int ret, ktime_t start),
+
+	TP_ARGS(dev, rw, sector, nr_sectors, ret, start),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	int,		rw		)
+		__field(	sector_t,	sector		)
+		__field(	unsigned int,	nr_sectors	)
+		__field(	int,		ret		)
+		__field(	s64,		duration_us	)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->rw		= rw;
+		__entry->sector		= sector;
+		__entry->nr_sectors	= nr_sectors;
+		__entry->ret		= ret;
+		__entry->duration_us	= ktime_us_delta(ktime_get(), start);
+	),
+
+	TP_printk("%d,%d %s %llu + %u ret %d %lldus",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->rw ? "W" : "R",
+		  (unsigned long long)__entry->sector, __entry->nr_sectors,
+		  __entry->ret, (long long)__entry->duration_us)
+);
+
+TRACE_EVENT(scsi_swap_create,
+
+	TP_PROTO(dev_t dev, sector_t src_sec, unsigned int nr_sectors,
+		 sector_t swap_sec, int result),
+
+	TP_ARGS(dev, src_sec, nr_sectors, swap_sec, result),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	sector_t,	src_sec		)
+		__field(	unsigned int,	nr_sectors	)
+		__field(	sector_t,	swap_sec	)
+		__field(	int,		result		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->src_sec	= src_sec;
+		__entry->nr_sectors	= nr_sectors;
+		__entry->swap_sec	= swap_sec;
+		__entry->result		= result;
+	),
+
+	TP_printk("%d,%d %llu + %u -> %lld result %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->src_sec, __entry->nr_sectors,
+		  (long long)__entry->swap_sec, __entry->result)
+);
+
+TRACE_EVENT(scsi_swap_recreate,
+
+	TP_PROTO(dev_t dev, sector_t src_sec, sector_t old_sec,
+		 sector_t new_sec, int ret),
+
+	TP_ARGS(dev, src_sec, old_sec, new_sec, ret),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	sector_t,	src_sec		)
+		__field(	sector_t,	old_sec		)
+		__field(	sector_t,	new_sec		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->src_sec	= src_sec;
+		__entry->old_sec	= old_sec;
+		__entry->new_sec	= new_sec;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("%d,%d %llu %llu -> %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->src_sec,
+		  (unsigned long long)__entry->old_sec,
+		  (unsigned long long)__entry->new_sec, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(scsi_swap_flush,
+
+	TP_PROTO(dev_t dev, int ret, ktime_t start),
+
+	TP_ARGS(dev, ret, start),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	int,		ret		)
+		__field(	s64,		duration_us	)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->ret		= ret;
+		__entry->duration_us	= ktime_us_delta(ktime_get(), start);
+	),
+
+	TP_printk("%d,%d ret %d %lldus",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->ret, (long long)__entry->duration_us)
+);
+
+DEFINE_EVENT(scsi_swap_flush, scsi_swap_table_commit,
+
+	TP_PROTO(dev_t dev, int ret, ktime_t start),
+
+	TP_ARGS(dev, ret, start)
+);
+
+DEFINE_EVENT(scsi_swap_flush, scsi_swap_head_flush,
+
+	TP_PROTO(dev_t dev, int ret, ktime_t start),
+
+	TP_ARGS(dev, ret, start)
+);
+
+DEFINE_EVENT(scsi_swap_flush, scsi_swap_log_flush,
+
+	TP_PROTO(dev_t dev, int ret, ktime_t start),
+
+	TP_ARGS(dev, ret, start)
+);
+
+TRACE_EVENT(scsi_swap_log_push,
+
+	TP_PROTO(dev_t dev, int type, int result, sector_t src, sector_t dst,
+		 unsigned int count),
+
+	TP_ARGS(dev, type, result, src, dst, count),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	int,		type		)
+		__field(	int,		result		)
+		__field(	sector_t,	src		)
+		__field(	sector_t,	dst		)
+		__field(	unsigned int,	count		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->type		= type;
+		__entry->result		= result;
+		__entry->src		= src;
+		__entry->dst		= dst;
+		__entry->count		= count;
+	),
+
+	TP_printk("%d,%d type %d result %d %llu -> %lld + %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->type, __entry->result,
+		  (unsigned long long)__entry->src, (long long)__entry->dst,
+		  __entry->count)
+);
+
+TRACE_EVENT(scsi_swap_hd_rw,
+
+	TP_PROTO(dev_t dev, int rw, sector_t sector, unsigned int nr_sectors,
+		 int result, ktime_t start),
+
+	TP_ARGS(dev, rw, sector, nr_sectors, result, start),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	int,		rw		)
+		__field(	sector_t,	sector		)
+		__field(	unsigned int,	nr_sectors	)
+		__field(	int,		result		)
+		__field(	s64,		duration_us	)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->rw		= rw;
+		__entry->sector		= sector;
+		__entry->nr_sectors	= nr_sectors;
+		__entry->result		= result;
+		__entry->duration_us	= ktime_us_delta(ktime_get(), start);
+	),
+
+	TP_printk("%d,%d %s %llu + %u result 0x%x %lldus",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->rw ? "W" : "R",
+		  (unsigned long long)__entry->sector, __entry->nr_sectors,
+		  __entry->result, (long long)__entry->duration_us)
+);
+
+#endif /* _TRACE_SCSI_SWAP_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
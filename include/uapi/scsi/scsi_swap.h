@@ -0,0 +1,31 @@
+#ifndef _UAPI_SCSI_SWAP_H
+#define _UAPI_SCSI_SWAP_H
+
+#include <linux/types.h>
+
+/*
+ * /sys/block/sdX/swap/table_bin 的记录, 每个映射一条, 按映射表顺序.
+ * 扇区号都是512字节单位. 读到0字节表示结束.
+ */
+struct scsi_swap_table_rec {
+	__u64 src_sec;		/* 源块起始扇区号 */
+	__u64 swap_sec;		/* 替换块起始扇区号 */
+	__u32 sec_size;		/* 块扇区数 */
+	__u32 index;		/* 替换块编号 */
+};
+
+/* /sys/block/sdX/swap/log_bin 的记录, 从旧到新 */
+struct scsi_swap_log_rec {
+	__u64 sec_src;
+	__u64 sec_dst;
+	__u32 time;			/* seconds since 1970-1-1 */
+	__u16 sec_count;
+	__u8 type;			/* enum LOG_TYPE */
+	__u8 result;
+	__u8 reboot_count;
+	__u8 fix_count;
+	__u8 curr_count;
+	__u8 reserved[5];
+};
+
+#endif